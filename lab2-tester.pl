@@ -166,8 +166,262 @@ close FOO;
       ') 2>/dev/null',
       "aX"
     ],
+
+# holes read as zeros, and pages written around them keep their data
+    # 18
+    [ 'echo a | ./osprdaccess -w ; echo b | ./osprdaccess -w -o 8192 ; ' .
+      './osprdaccess -r 4096 -o 4096 | tr -d "\\000" | wc -c ; ' .
+      './osprdaccess -r 1 ; ./osprdaccess -r 1 -o 8192',
+      "0 ab" ],
+
+# discarding a range
+    # 19
+    [ '(echo test1 | ./osprdaccess -w) && ' .
+      '(echo sector2 | ./osprdaccess -w -o 512) && ' .
+      './osprdctl discard /dev/osprda 0 512 && ' .
+      '(./osprdaccess -r 528 | hexdump -C)',
+      "00000000 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |................| " .
+      "* " .
+      "00000200 73 65 63 74 6f 72 32 0a 00 00 00 00 00 00 00 00 |sector2.........| " .
+      "00000210" ],
+
+# identical full pages are stored once, and zero pages not at all
+    # 20
+    [ 'yes x | head -c 4096 | ./osprdaccess -w 4096 ; ' .
+      'yes x | head -c 4096 | ./osprdaccess -w 4096 -o 4096 ; ' .
+      'head -c 4096 /dev/zero | ./osprdaccess -w 4096 -o 8192 ; ' .
+      './osprdctl stats /dev/osprda | grep -E "^(used_bytes|dedup_saved_bytes)" ; ' .
+      './osprdaccess -r 2 -o 4096',
+      "used_bytes 4096 dedup_saved_bytes 4096 x",
+      "dedup=1" ],
+
+# growing a device in place
+    # 21
+    [ '(echo keep | ./osprdaccess -w) && ' .
+      './osprdctl resize /dev/osprda 32768 && ' .
+      '(echo grown | ./osprdaccess -w -o 20000) && ' .
+      './osprdaccess -r 4 && ./osprdaccess -r 5 -o 20000 ; ' .
+      './osprdctl resize /dev/osprda 16384',
+      "keepgrown" ],
+
+# a device with 4096-byte blocks says so, and keeps partial-block writes
+    # 22
+    [ './osprdctl stats /dev/osprda | grep ^block_size ; ' .
+      'echo test1 | ./osprdaccess -w -o 4100 ; ' .
+      './osprdaccess -r 6 -o 4100',
+      "block_size 4096 test1",
+      "block_size=4096" ],
+
+# reading through mmap
+    # 23
+    [ '(echo mapped | ./osprdaccess -w -o 4100) && ' .
+      './osprdaccess -r 6 -o 4100 -m',
+      "mapped" ],
+
+# pages go on the NUMA node asked for
+    # 24
+    [ 'echo a | ./osprdaccess -w ; ./osprdaccess -r 1 ; ' .
+      './osprdctl stats /dev/osprda | grep -E "^(numa_node|node0_pages) "',
+      "a numa_node 0 node0_pages 1",
+      "numa_node=0" ],
+
+# interleaved pages from 2MB extents hold data like any others
+    # 25
+    [ 'echo a | ./osprdaccess -w ; echo b | ./osprdaccess -w -o 8192 ; ' .
+      './osprdaccess -r 1 ; ./osprdaccess -r 1 -o 8192 ; ' .
+      './osprdctl stats /dev/osprda | grep -E "^(interleave|hugepages) "',
+      "ab interleave 1 hugepages 1",
+      "interleave=1 hugepages=1" ],
+
+# snapshot: keeps the old contents while the origin changes
+    # 26
+    [ '(echo before | ./osprdaccess -w) && ' .
+      './osprdctl snapshot /dev/osprda:/dev/osprde && ' .
+      '(echo after_ | ./osprdaccess -w) && ' .
+      './osprdaccess -r 6 /dev/osprde && ./osprdaccess -r 6 ; ' .
+      './osprdctl destroy /dev/osprde',
+      "/dev/osprde beforeafter_" ],
+
+# save and restore an image
+    # 27
+    [ '(echo saved | ./osprdaccess -w -o 9000) && ' .
+      './osprdctl save /dev/osprda lab2image.img && ' .
+      './osprdaccess -w -z && ' .
+      './osprdctl restore /dev/osprda lab2image.img && ' .
+      './osprdaccess -r 5 -o 9000 ; rm -f lab2image.img',
+      "saved" ],
+
+# a flush writes dirty data back to the backing file
+    # 28
+    [ 'echo flushed | ./osprdaccess -w ; ./osprdctl flush ; ' .
+      'head -c 7 /tmp/osprda.dat ; echo ; ' .
+      './osprdctl stats /dev/osprda | grep ^dirty_pages ; ' .
+      'rm -f /tmp/osprd?.dat',
+      "flushed dirty_pages 0",
+      "queue_mode=1 backing_dir=/tmp" ],
+
+# a device over its RAM budget spills pages to a file and reads them back
+    # 29
+    [ './osprdctl create -m 8192 65536 /dev/osprde >/dev/null ; ' .
+      'for i in 0 1 2 3 4 5 6 7 ; do ' .
+      'echo page$i | ./osprdaccess -w -o $((i * 4096)) /dev/osprde ; done ; ' .
+      'sleep 1.5 ; ./osprdaccess -r 6 -o 8192 /dev/osprde ; ' .
+      './osprdctl stats /dev/osprde | awk \'/^evictions/ { print ($2 > 0) }\' ; ' .
+      './osprdctl destroy /dev/osprde ; rm -f /tmp/osprde.spill',
+      "page2 1",
+      "queue_mode=1 spill_dir=/tmp" ],
+
+# many read locks held at once all go away, and let a writer in
+    # 30
+    [ 'echo a | ./osprdaccess -w 1 ; ' .
+      'for i in 1 2 3 4 5 6 7 8 ; do ' .
+      './osprdaccess -r 1 -l -d 0.4 >/dev/null & done ; ' .
+      'sleep 0.2 ; echo b | ./osprdaccess -w 1 -L ; ' .
+      'wait ; echo c | ./osprdaccess -w 1 -L ; ./osprdaccess -r 1 -L',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy c" ],
+
+# range locks: writers of disjoint ranges don't wait for each other
+    # 31
+    [ '(echo aaa | ./osprdaccess -w 3 -R -l -d 0.5) & ' .
+      'sleep 0.2 ; (echo b | ./osprdaccess -w 1 -o 4096 -R -L) ; ' .
+      '(echo c | ./osprdaccess -w 1 -o 2 -R -L) ; ' .
+      './osprdaccess -r 1 -o 4096 ; ./osprdaccess -r 3 -l',
+      "ioctl OSPRDIOCTRYACQUIRERANGE: Device or resource busy baaa" ],
+
+# a released lock is handed to one waiter, not fought over by all of them
+    # 32
+    [ './osprdbench -c 8 -s 1 | ' .
+      'awk \'{ print ($4 > 0 && $6 < 3 ? "ok" : $0) }\'',
+      "ok" ],
+
+# reader batching: a reader can pass a writer waiting behind a reader
+    # 33
+    [ 'echo a | ./osprdaccess -w 1 ; ' .
+      './osprdctl policy /dev/osprda batch ; ' .
+      '(./osprdaccess -r 1 -l -d 0.6 >/dev/null &) ; ' .
+      '(sleep 0.2 ; echo b | ./osprdaccess -w 1 -l &) ; ' .
+      'sleep 0.4 ; ./osprdaccess -r 1 -l ; sleep 0.4 ; ./osprdaccess -r 1 ; ' .
+      './osprdctl policy /dev/osprda fifo',
+      "ab" ],
+
+# a timed lock request gives up, and leaves the queue intact
+    # 34
+    [ '(echo aa | ./osprdaccess -w 2 -l -d 0.6) & ' .
+      'sleep 0.2 ; (echo b | ./osprdaccess -w 1 -l -T 0.2) ; ' .
+      './osprdaccess -r 2 -l',
+      "ioctl OSPRDIOCACQUIRETIMEOUT: Connection timed out aa" ],
+
+# a downgraded lock lets readers in; upgrading it back keeps out writers
+    # 35
+    [ 'echo xy | ./osprdaccess -w 2 ; ' .
+      '(echo aa | ./osprdaccess -w 2 -l -D -d 0.4 -U) & ' .
+      'sleep 0.2 ; ./osprdaccess -r 1 -L ; sleep 0.4 ; ./osprdaccess -r 2 -l',
+      "xaa" ],
+
+# a lock request that would close a cycle across devices is refused
+    # 36
+    [ '(echo a | ./osprdaccess -w 1 -l /dev/osprda -d 0.4 -l /dev/osprdb) & ' .
+      'sleep 0.2 ; ' .
+      'echo b | ./osprdaccess -w 1 -l /dev/osprdb -d 0.4 -l /dev/osprda ; ' .
+      'sleep 0.8 ; ./osprdaccess -r 1 /dev/osprdb',
+      "ioctl OSPRDIOCACQUIRE: Resource deadlock avoided a" ],
+
+# many processes locking several devices in random order never hang
+    # 37
+    [ './osprdbench -x 8 -s 2 >/dev/null && echo ok',
+      "ok" ],
+
+# locking several devices at once takes them in the same order every time
+    # 38
+    [ '(echo a | ./osprdaccess -w 1 -l -M -d 0.4 /dev/osprda /dev/osprdb) & ' .
+      'sleep 0.2 ; ' .
+      'echo b | ./osprdaccess -w 1 -L -M /dev/osprdb /dev/osprda ; ' .
+      'echo c | ./osprdaccess -w 1 -l -M /dev/osprdb /dev/osprda ; ' .
+      './osprdaccess -r 1 /dev/osprdb ; ./osprdaccess -r 1 /dev/osprda',
+      "ioctl OSPRDIOCTRYACQUIREMULTI: Device or resource busy ac" ],
+
+# a queued lock request polls readable once granted, and can be withdrawn
+    # 39
+    [ '(echo aa | ./osprdaccess -w 2 -l -d 0.6) & ' .
+      'sleep 0.2 ; ./osprdaccess -r 2 -l -P -T 0.1 ; ' .
+      './osprdaccess -r 2 -l -P',
+      "osprdaccess: lock request timed out aa" ],
+
+# lock instrumentation in debugfs counts granted and refused requests
+    # 40
+    [ '(grep -q debugfs /proc/mounts || mount -t debugfs none /sys/kernel/debug) ; ' .
+      'echo 1 > /sys/kernel/debug/osprd/osprda/reset ; ' .
+      './osprdaccess -r 1 -l >/dev/null ; ' .
+      '(echo a | ./osprdaccess -w 1 -l -d 0.4) & sleep 0.2 ; ' .
+      './osprdaccess -r 1 -L >/dev/null 2>&1 ; sleep 0.6 ; ' .
+      'grep -E "^(acquires|releases|try_fails)" /sys/kernel/debug/osprd/osprda/lock_stats',
+      "acquires_read 1 releases_read 1 acquires_write 1 releases_write 1 try_fails 1" ],
+
+# range locks taken in zig-zag order (forcing a double rotation) still
+# keep out an overlapping writer
+    # 41
+    [ '(./osprdaccess -r 1 -o 0 -R -l -d 0.8 >/dev/null &) ; sleep 0.1 ; ' .
+      '(./osprdaccess -r 100 -o 200 -R -l -d 0.7 >/dev/null &) ; sleep 0.1 ; ' .
+      '(./osprdaccess -r 1 -o 100 -R -l -d 0.6 >/dev/null &) ; sleep 0.1 ; ' .
+      'echo x | ./osprdaccess -w 1 -o 250 -R -L ; sleep 0.6',
+      "ioctl OSPRDIOCTRYACQUIRERANGE: Device or resource busy" ],
+
+# a device that was opened and closed again can be destroyed
+    # 42
+    [ './osprdctl create 8192 /dev/osprde >/dev/null && ' .
+      'echo a | ./osprdaccess -w 1 /dev/osprde && ' .
+      './osprdaccess -r 1 /dev/osprde && ' .
+      './osprdctl destroy /dev/osprde && echo ok',
+      "aok" ],
+
+# cold pages are compressed in the background, and read back intact
+    # 43
+    [ 'echo compressed | ./osprdaccess -w ; sleep 3 ; ' .
+      './osprdctl stats /dev/osprda | grep ^compressed_pages ; ' .
+      './osprdaccess -r 11 ; ' .
+      './osprdctl stats /dev/osprda | grep -E "^(compressed_pages|decompressions)"',
+      "compressed_pages 1 compressed compressed_pages 0 decompressions 1",
+      "queue_mode=1 compress_interval=1" ],
+
+# unloading writes compressed dirty pages back to the backing file
+    # 44
+    [ 'echo unloaded | ./osprdaccess -w ; sleep 3 ; ' .
+      './osprdctl stats /dev/osprda | grep ^compressed_pages ; ' .
+      'rmmod osprd ; head -c 8 /tmp/osprda.dat ; echo ; ' .
+      'rm -f /tmp/osprd?.dat ; ' .
+      'insmod osprd.ko queue_mode=1 compress_interval=1 flush_interval=60 ' .
+      'backing_dir=/tmp && ./create-devs',
+      "compressed_pages 1 unloaded",
+      "queue_mode=1 compress_interval=1 flush_interval=60 backing_dir=/tmp" ],
+
+# a task that holds a read lock can't take a second one, fast path or not
+    # 45
+    [ 'echo a | ./osprdaccess -w 1 ; ' .
+      './osprdaccess -r 1 -l /dev/osprda -l /dev/osprda',
+      "ioctl OSPRDIOCACQUIRE: Resource deadlock avoided" ],
+
+# only a file open for writing can upgrade its lock
+    # 46
+    [ 'echo a | ./osprdaccess -w 1 ; ./osprdaccess -r 1 -l -U',
+      "ioctl OSPRDIOCUPGRADE: Bad file descriptor" ],
+
+# locks taken together can be downgraded and upgraded together
+    # 47
+    [ 'echo x | ./osprdaccess -w 1 /dev/osprdb ; ' .
+      '(echo b | ./osprdaccess -w 1 -l -M -D -d 0.4 -U /dev/osprda /dev/osprdb) & ' .
+      'sleep 0.2 ; ./osprdaccess -r 1 -L /dev/osprdb ; ' .
+      'sleep 0.4 ; ./osprdaccess -r 1 -l /dev/osprdb',
+      "xb" ],
     );
 
+# Rerun the basic read and write tests (1-5) with the module loaded each
+# of these ways.
+foreach $opts ("queue_mode=1", "queue_mode=2", "block_size=4096") {
+    foreach $i (0..4) {
+	push(@tests, [ $tests[$i][0], $tests[$i][1], $opts ]);
+    }
+}
+
 my($ntest) = 0;
 
 my($sh) = "bash";
@@ -177,6 +431,17 @@ my($ntestdone) = 0;
 my($zerodiskcmd) = "./osprdaccess -w -z";
 my(@disks) = ("/dev/osprda", "/dev/osprdb", "/dev/osprdc", "/dev/osprdd");
 
+# A test may give, as a third element, the options the module must be
+# loaded with to run it.  The module is reloaded whenever they change, and
+# once more at the end with no options.
+my($modopts) = "";
+
+sub load_module ($) {
+    my($opts) = @_;
+    `rmmod osprd ; insmod osprd.ko $opts && ./create-devs`;
+    $modopts = $opts;
+}
+
 my(@testarr, $anytests);
 foreach $arg (@ARGV) {
     if ($arg =~ /^\d+$/) {
@@ -189,6 +454,9 @@ foreach $test (@tests) {
 
     $ntest++;
     next if $anytests && !$testarr[$ntest];
+    my($in, $want, $opts) = @$test;
+    $opts = "" if !defined($opts);
+    load_module($opts) if $opts ne $modopts;
 
     # clean up the disk for the next test
     foreach $disk (@disks) {
@@ -197,7 +465,6 @@ foreach $test (@tests) {
 
     $ntestdone++;
     print STDOUT "Starting test $ntest\n";
-    my($in, $want) = @$test;
     open(F, ">$tempfile") || die;
     print F $in, "\n";
     print STDERR $in, "\n";
@@ -215,6 +482,7 @@ foreach $test (@tests) {
     $ntestfailed++;
 }
 
+load_module("") if $modopts ne "";
 unlink($tempfile);
 my($ntestpassed) = $ntestdone - $ntestfailed;
 print "$ntestpassed of $ntestdone tests passed\n";
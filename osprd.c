@@ -13,6 +13,30 @@
 #include <linux/blkdev.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/zlib.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/fs.h>
+#include <linux/completion.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/rbtree.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/uaccess.h>
+#include <asm/div64.h>
 
 #include "spinlock.h"
 #include "osprd.h"
@@ -20,10 +44,16 @@
 /* The size of an OSPRD sector. */
 #define SECTOR_SIZE	512
 
+/* Number of sectors in each page of the backing store. */
+#define SECTORS_PER_PAGE	(PAGE_SIZE / SECTOR_SIZE)
+
 /* This flag is added to an OSPRD file's f_flags to indicate that the file
  * is locked. */
 #define F_OSPRD_LOCKED	0x80000
 
+/* And this one while a lock request made with OSPRDIOCENQUEUE is queued. */
+#define F_OSPRD_QUEUED	0x100000
+
 /* eprintk() prints messages to the console.
  * (If working on a real Linux machine, change KERN_NOTICE to KERN_ALERT or
  * KERN_EMERG so that you are sure to see the messages.  By default, the
@@ -38,42 +68,437 @@ MODULE_AUTHOR("Brandon Liu & Jennifer Liaw");
 
 #define OSPRD_MAJOR	222
 
-/* This module parameter controls how big the disk will be.
+/* This module parameter controls how big the disks created at load time
+ * will be.
  * You can specify module parameters when you load the module,
  * as an argument to insmod: "insmod osprd.ko nsectors=4096" */
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
-typedef struct node {
-	unsigned val;
-	struct node *next;
-} node_t;
+/* This module parameter sets the logical block size of the disks created at
+ * load time: 512 (the default) or 4096.  With 4096, the block layer only
+ * sends whole, page-aligned blocks, which osprd copies a page at a time. */
+static int block_size = SECTOR_SIZE;
+module_param(block_size, int, 0);
+
+/* These module parameters control where the disks created at load time
+ * keep their data.
+ *   numa_node: allocate pages on this NUMA node (-1, the default, allocates
+ *      them wherever the writing task runs).
+ *   interleave: 1 spreads pages across all online nodes instead.
+ *   hugepages: 1 allocates pages in physically contiguous, directly mapped
+ *      extents of 1 << OSPRD_EXTENT_ORDER pages, so the kernel reaches them
+ *      through its large-page mappings instead of 4K kmap()s.
+ * Devices created through /dev/osprdctl choose their own. */
+static int numa_node = -1;
+module_param(numa_node, int, 0);
+static int interleave = 0;
+module_param(interleave, int, 0);
+static int hugepages = 0;
+module_param(hugepages, int, 0);
+
+/* Size of the extents allocated with 'hugepages': 2MB with 4K pages. */
+#define OSPRD_EXTENT_ORDER	9
+
+/* This module parameter controls how many disks are created at load time.
+ * More can be created, and any of them destroyed or resized, later through
+ * the OSPRDIOCCREATE, OSPRDIOCDESTROY and OSPRDIOCRESIZE ioctls on
+ * /dev/osprdctl. */
+static int ndevices = 4;
+module_param(ndevices, int, 0);
+
+/* This module parameter selects how requests reach the ramdisk.
+ *   0: a normal request queue; the elevator merges and sorts requests and
+ *      osprd_process_request copies them one chunk at a time.
+ *   1: a make_request function that bypasses the elevator and copies every
+ *      segment of each bio directly (osprd_make_request).
+ *   2: like 1, but the backing store is split into one shard per CPU, each
+ *      with its own lock, so that submitters on different CPUs rarely
+ *      contend.
+ * Load with "insmod osprd.ko queue_mode=1" to compare them. */
+#define OSPRD_QUEUE_RQ		0
+#define OSPRD_QUEUE_BIO		1
+#define OSPRD_QUEUE_MQ		2
+static int queue_mode = OSPRD_QUEUE_RQ;
+module_param(queue_mode, int, 0);
+
+/* This module parameter turns on compression of cold data: pages that have
+ * not been read or written for 'compress_interval' seconds are compressed
+ * in the background and decompressed again on their next access.
+ * 0 (the default) leaves every page uncompressed.  Needs queue_mode 1 or
+ * 2, so that pages are decompressed in a context that can sleep. */
+static int compress_interval = 0;
+module_param(compress_interval, int, 0);
+
+/* This module parameter turns on duplicate-page elimination: a page written
+ * in full whose contents match another page in the same shard of the same
+ * ramdisk shares that page (copy-on-write) instead of keeping its own
+ * copy.  All-zero pages are never stored, whether or not this is set. */
+static int dedup = 0;
+module_param(dedup, int, 0);
+
+/* This module parameter names a directory for warm restarts.  If set, the
+ * disks created at load time are restored from the image files there
+ * (osprda.img, osprdb.img, ...) that exist, and every disk is saved to one
+ * when the module is unloaded.  Loading takes time proportional to the
+ * data in the images, not to the disks' sizes.  Images can also be saved
+ * and restored at any time through OSPRDIOCSAVE and OSPRDIOCRESTORE on
+ * /dev/osprdctl. */
+static char *image_dir = NULL;
+module_param(image_dir, charp, 0);
+
+/* Image records are read and written this many at a time, and at most
+ * OSPRD_RESTORE_THREADS threads load an image in parallel. */
+#define OSPRD_IMAGE_BATCH	16
+#define OSPRD_RESTORE_THREADS	8
+
+/* These module parameters turn the disks into write-back caches of regular
+ * files: each disk's data is kept in <backing_dir>/osprda.dat, ...
+ *   backing_dir: the directory.  At creation a disk loads its file's
+ *      non-zero pages; writes complete in RAM and only mark pages dirty.
+ *   flush_interval: how often, in seconds, osprd_flushd writes the dirty
+ *      pages back, in sorted and coalesced runs.
+ * Barrier bios and OSPRDIOCFLUSH write everything back and sync the file
+ * before completing, so a crash loses at most 'flush_interval' seconds of
+ * writes since the last of them.  Needs queue_mode 1 or 2, whose requests
+ * are handled in a context that can sleep.  Snapshots and clones are not
+ * backed. */
+static char *backing_dir = NULL;
+module_param(backing_dir, charp, 0);
+static int flush_interval = 5;
+module_param(flush_interval, int, 0);
+
+/* These module parameters let a disk be larger than the RAM it uses.
+ *   ram_limit_mb: RAM budget of each disk created at load time, in MB;
+ *      0 (the default) means no limit.  Devices created through
+ *      /dev/osprdctl choose their own.
+ *   spill_dir: directory for the spill files (osprda.spill, ...).
+ * Once a disk's resident pages pass its budget, osprd_spilld writes the
+ * least recently used ones (by the CLOCK algorithm) to the disk's spill
+ * file and frees them; they are read back on their next access.  Needs
+ * queue_mode 1 or 2, and cannot be combined with backing_dir.  Snapshots
+ * cannot be taken of a disk with a budget. */
+static int ram_limit_mb = 0;
+module_param(ram_limit_mb, int, 0);
+static char *spill_dir = NULL;
+module_param(spill_dir, charp, 0);
+
+/* This module parameter sets the lock fairness policy (OSPRD_POLICY_* in
+ * osprd.h) of every new disk; OSPRDIOCSETPOLICY changes a disk's policy.
+ *   0: strict FIFO.  A queued writer holds up every later request.
+ *   1: reader batching.  Queued readers pass a writer that is waiting for
+ *      the lock, until OSPRD_MAX_BYPASS batches have passed it.
+ *   2: phase-fair.  Readers that queued during a write phase all pass the
+ *      waiting writers once it ends; readers that queue during a read phase
+ *      wait for the next writer.  So a reader waits for at most one write
+ *      phase, and a writer for at most one read phase per writer ahead. */
+static int lock_policy = OSPRD_POLICY_FIFO;
+module_param(lock_policy, int, 0);
+#define OSPRD_MAX_BYPASS	16
+
+/* This module parameter turns lock instrumentation on or off: counts of
+ * lock requests and their outcomes, and histograms of wait and hold times.
+ * They are shown in debugfs, in osprd/osprdX/lock_stats; writing to
+ * osprd/osprdX/reset zeroes them.  osprd/lock_stats changes the setting
+ * at run time.  When it is off, each instrumented point costs one test. */
+static unsigned lock_stats = 1;
+module_param(lock_stats, uint, 0);
+
+/* The flusher looks for dirty pages OSPRD_FLUSH_WINDOW pages at a time,
+ * and writes runs of up to OSPRD_FLUSH_RUN contiguous pages. */
+#define OSPRD_FLUSH_WINDOW	256
+#define OSPRD_FLUSH_RUN		32
+
+/* Radix tree tag for pages that differ from the backing file. */
+#define OSPRD_TAG_DIRTY		0
+
+/* Number of buckets in each shard's duplicate-page hash table. */
+#define OSPRD_DEDUP_BUCKETS	1024
+
+/* Compression is only available if the kernel has zlib. */
+#if (defined(CONFIG_ZLIB_DEFLATE) || defined(CONFIG_ZLIB_DEFLATE_MODULE)) \
+    && (defined(CONFIG_ZLIB_INFLATE) || defined(CONFIG_ZLIB_INFLATE_MODULE))
+#define OSPRD_HAVE_ZLIB 1
+#endif
+
+/* With queue_mode=2, runs of 1 << OSPRD_SHARD_SHIFT pages go to the same
+ * shard, so a sequential request usually takes only one shard lock. */
+#define OSPRD_SHARD_SHIFT	4
+
+/* A compressed page is only kept if it saves at least a quarter. */
+#define OSPRD_MAX_ZLEN	(PAGE_SIZE - PAGE_SIZE / 4)
+
+/* A physical page shared by several store entries with identical contents.
+ * Entries that share a page must copy it before writing to it. */
+typedef struct osprd_shared {
+	struct hlist_node hash;		// in osprd_shard_t's 'dedup_hash'
+	u32 csum;			// hash of the page's contents
+	unsigned refs;			// number of osprd_page_t's using it
+	struct page *page;
+} osprd_shared_t;
+
+/* One page of a ramdisk's backing store, as kept in osprd_shard_t's 'pages'
+ * tree.  The data is resident in 'page' or, once the page has gone cold,
+ * compressed in 'zdata'. */
+typedef struct osprd_page {
+	pgoff_t index;			// page offset in the ramdisk
+	struct page *page;		// resident data, or NULL
+	osprd_shared_t *shared;		// non-NULL if 'page' is in the
+					//   dedup table (maybe shared)
+	void *zdata;			// compressed data when 'page' is NULL
+	unsigned zlen;			// length of 'zdata'
+	unsigned flags;			// OSPRD_PG_* flags below
+	unsigned gen;			// bumped on every write
+	unsigned epoch;			// device's 'epoch' when the snapshot
+					//   last got its own copy
+	unsigned long atime;		// jiffies of the last access
+} osprd_page_t;
+
+#define OSPRD_PG_INCOMPRESSIBLE	0x1	// compression did not pay off;
+					// don't retry until rewritten
+#define OSPRD_PG_MAPPED		0x2	// 'page' has been mmapped, so it
+					// must stay resident and private
+#define OSPRD_PG_ZERO		0x4	// no data; reads as zeros.  Used by
+					// snapshots and clones, where a
+					// missing page means "same as the
+					// origin" rather than a hole
+#define OSPRD_PG_SPILLED	0x8	// the data is in the spill file, at
+					// offset index * PAGE_SIZE
+#define OSPRD_PG_REFERENCED	0x10	// accessed since the eviction clock
+					// hand last passed
+
+/* A slice of a ramdisk's backing store.  Page 'idx' lives in shard
+ * (idx >> OSPRD_SHARD_SHIFT) & (nshards - 1); see osprd_shard(). */
+typedef struct osprd_shard {
+	struct radix_tree_root pages;   // The data: osprd_page_t's indexed
+	                                // by page offset.  Pages are
+	                                // allocated on first write; holes
+	                                // read as zeros.
+	spinlock_t lock;                // Protects 'pages', the counters
+	                                //   below, and the page contents
+	                                //   during a copy.
+	unsigned long npages;           // Number of resident physical pages
+	unsigned long nzpages;          // Number of compressed pages
+	unsigned long zbytes;           // Total size of compressed pages
+	unsigned long long ndecompress; // Number of decompressions, and
+	unsigned long long decompress_ns; //   the total time they took
+	struct hlist_head *dedup_hash;  // Pages available for sharing,
+	                                //   hashed by contents (if 'dedup')
+	unsigned long nshared;          // Page copies saved by sharing
+	unsigned long long nzero;       // Writes of zeros that stored nothing
+	unsigned long ncow;             // Pages copied here from the origin
+	                                //   before it overwrote them
+	unsigned long ndirty;           // Pages tagged OSPRD_TAG_DIRTY
+	unsigned long budget;           // This shard's share of the device's
+	                                //   RAM budget in pages, or 0
+	unsigned long nspilled;         // Pages in the spill file
+	unsigned long long nhits;       // Accesses to resident pages, and
+	unsigned long long nmisses;     //   pages read back from the file
+	unsigned long long nevict;      // Pages written out to the file
+	pgoff_t clock_hand;             // Where eviction resumes scanning
+	unsigned long node_pages[OSPRD_MAX_NODES];
+	                                // Resident pages on each NUMA node
+
+	struct osprd_info *dev;         // The device this shard belongs to
+	spinlock_t pool_lock;           // Protects the fields below
+	struct list_head pool;          // Unused pages split from extents
+	                                //   (if the device uses hugepages)
+	unsigned long nextents;         // Number of extents allocated
+	int next_node;                  // Node of the next extent, if
+	                                //   interleaving
+} ____cacheline_aligned_in_smp osprd_shard_t;
+
+/* I/O counters, kept per CPU and summed by OSPRDIOCSTATS. */
+typedef struct osprd_iostat {
+	unsigned long long ios[2];      // Requests, indexed by READ/WRITE
+	unsigned long long bytes[2];    // Bytes, indexed by READ/WRITE
+} osprd_iostat_t;
+
+/* Lock instrumentation, kept per CPU and summed for debugfs.  Arrays of
+ * two are indexed by write.  Histogram bucket i > 0 counts times in
+ * [2^(i-1), 2^i) ns; the last bucket also counts anything longer.  Every
+ * field is an unsigned long, so the struct can be summed as an array. */
+#define OSPRD_HIST_BUCKETS	48
+typedef struct osprd_lockstat {
+	unsigned long acquires[2];      // Locks granted
+	unsigned long releases[2];
+	unsigned long try_fails;        // Requests refused with -EBUSY,
+	unsigned long deadlocks;        //   with -EDEADLK,
+	unsigned long interrupts;       //   or cut short by a signal,
+	unsigned long timeouts;         //   or by a timeout
+	unsigned long wait_hist[2][OSPRD_HIST_BUCKETS];
+	unsigned long hold_hist[2][OSPRD_HIST_BUCKETS];
+} osprd_lockstat_t;
+
+/* Lock bookkeeping.  Tasks waiting for a lock are queued in ticket order
+ * on d->waiters.  Whoever frees a lock hands it over: it grants the locks
+ * of the waiters at the front of the queue that can now go, and wakes
+ * just those tasks.  A waiter woken by a signal unlinks itself in O(1).
+ * A read lock being upgraded waits at the front of the queue, holding its
+ * place in line.
+ * Lock holders are hashed by pid, for deadlock detection, and by file, for
+ * release.  Waiters on all devices are also hashed by pid, so that a
+ * request that would close a cycle of tasks waiting for each other's locks
+ * is refused with -EDEADLK; see osprd_deadlocked.  Each lock covers a byte
+ * range of the device (all of it for OSPRDIOCACQUIRE); to check for
+ * conflicts, held ranges are kept in two interval trees, one for read
+ * locks and one for write locks.
+ *
+ * While no write lock is held or wanted, whole-device read locks take a
+ * fast path: the holder goes on a per-CPU list, under a per-CPU lock, and
+ * d->mutex isn't touched.  A writer turns the fast path off and waits for
+ * those readers to drain. */
+#define OSPRD_HOLDER_BITS	4
+#define OSPRD_HOLDER_HASH	(1 << OSPRD_HOLDER_BITS)
+#define OSPRD_TASK_BITS		8
+#define OSPRD_TASK_HASH		(1 << OSPRD_TASK_BITS)
+
+/* A lock on a device, held through one open file. */
+typedef struct osprd_holder {
+	struct hlist_node pid_link;     // In the device's 'holders', or a
+	                                //   fast reader's per-CPU list
+	struct hlist_node filp_link;    // In the device's 'holder_files'
+	pid_t pid;                      // Task that acquired the lock
+	struct file *filp;              // File the lock is held through
+	int write;                      // 1 for a write lock
+	unsigned long long start;       // Locked bytes: [start, end)
+	unsigned long long end;
+	struct rb_node range_node;      // In d->read_ranges or write_ranges,
+	                                //   ordered by 'start'
+	unsigned long long max_end;     // Largest 'end' in this subtree
+	int cpu;                        // Fast readers: CPU whose list this
+	                                //   is on
+	unsigned long long since;       // When granted, in ns, if lock
+	                                //   instrumentation was on; else 0
+} osprd_holder_t;
+
+/* Read locks taken on the fast path, on one CPU. */
+typedef struct osprd_readers {
+	spinlock_t lock;
+	unsigned long count;            // Length of 'holders'
+	struct hlist_head holders;
+} osprd_readers_t;
+
+/* A task waiting for a lock.  Lives on the waiting task's stack, or, for
+ * a request queued with OSPRDIOCENQUEUE, is allocated; then no task
+ * sleeps on it, and osprd_grant frees it. */
+typedef struct osprd_waiter {
+	struct list_head link;          // In d->waiters, in ticket order
+	struct hlist_node pid_link;     // In osprd_waiting, unless 'queued'
+	struct hlist_node filp_link;    // If 'queued', in d->queued_files
+	struct osprd_info *d;           // Device it waits on
+	struct task_struct *task;
+	pid_t pid;                      //   and that task's pid
+	osprd_holder_t *h;              // The lock it wants
+	struct file *filp;              //   and the file it wants it for
+	unsigned ticket;
+	int granted;                    // Set when the lock is handed over
+	int upgrade;                    // Upgrading a read lock it holds
+	int queued;                     // Queued by OSPRDIOCENQUEUE
+	unsigned bypassed;              // Times readers passed this writer
+	ktime_t start;                  // When it queued
+	struct list_head search_link;   // In a deadlock search's queue
+	unsigned visit;                 // Last search that reached it
+} osprd_waiter_t;
+
+/* Waiters on all devices, hashed by pid.  osprd_wfg_lock protects this
+ * table and, for every device, d->waiters and the range trees, so that a
+ * deadlock search sees every device at one instant.  It nests inside
+ * d->mutex and outside the per-CPU reader locks. */
+static struct hlist_head osprd_waiting[OSPRD_HOLDER_HASH];
+static DEFINE_SPINLOCK(osprd_wfg_lock);
+static unsigned osprd_search_gen;
 
 /* The internal representation of our device. */
 typedef struct osprd_info {
-	uint8_t *data;                  // The data array. Its size is
-	                                // (nsectors * SECTOR_SIZE) bytes.
+	sector_t nsectors;              // Size of the device in sectors
+	unsigned block_size;            // Logical block size: 512 or 4096
+	int numa_node;                  // Node for the data, or -1 for any
+	unsigned flags;                 // OSPRD_DEV_INTERLEAVE and/or
+	                                //   OSPRD_DEV_HUGEPAGES
+	unsigned users;                 // Number of opens, including the
+	                                //   kernel's own; protected by
+	                                //   osprd_devices_lock
+	int restoring;                  // Set while an image is loading;
+	                                //   protected by osprd_devices_lock
+
+	struct osprd_info *origin;      // Device this is a snapshot or clone
+	                                //   of; pages missing here are read
+	                                //   from it
+	struct osprd_info *dep;         // This device's snapshot or clone.
+	                                //   Set and cleared with all of
+	                                //   this device's shard locks held.
+	unsigned epoch;                 // Bumped by every snapshot; see
+	                                //   osprd_page_t's 'epoch'
+	unsigned nwmaps;                // Writable shared mappings; protected
+	                                //   by osprd_devices_lock
+
+	struct file *backing;           // Backing file, or NULL
+	struct mutex flush_mutex;       // Serializes flushes; protects the
+	                                //   fields below
+	uint8_t *flush_buf;             // OSPRD_FLUSH_RUN pages being written
+	pgoff_t *flush_idx;             // OSPRD_FLUSH_WINDOW dirty pages
+	unsigned long long nflush_runs; // Writes to the backing file, and
+	unsigned long long flush_bytes; //   the bytes written
+
+	unsigned long long ram_limit;   // RAM budget in bytes, or 0
+	struct file *spill;             // Spill file, if there is a budget
+
+	osprd_shard_t *shards;          // The data, split by page offset
+	unsigned nshards;               //   (a power of 2; 1 unless
+	                                //   queue_mode=2)
+	osprd_iostat_t *iostat;         // Per-CPU I/O counters
 
 	osp_spinlock_t mutex;           // Mutex for synchronizing access to
 					// this block device
 
-	unsigned ticket_head;		// Currently running ticket for
+	unsigned ticket_head;		// Next available ticket for
 					// the device lock
 
-	unsigned ticket_tail;		// Next available ticket for
-					// the device lock
+	unsigned ticket_tail;		// Currently running ticket for
+					// the device lock: the first
+					// waiter's, or ticket_head
 
-	wait_queue_head_t blockq;       // Wait queue for tasks blocked on
-					// the device lock
+	wait_queue_head_t blockq;       // Wait queue for tasks polling
+					// for a queued lock
+
+	struct list_head waiters;	// Tasks blocked on the device
+					// lock, as osprd_waiter_t
 
 	/* HINT: You may want to add additional fields to help
 	         in detecting deadlock. */
 	unsigned nread;	// how many processes are holding the read lock
 	unsigned nwrite; // how many processes are holding the write lock
 
-	node_t *invalid_tickets;	//linked list for invalid tickets
-	node_t *write_locking_pids;	// linked list for write lock pids
-	node_t *read_locking_pids;  // linked list for read lock pids
+	struct hlist_head holders[OSPRD_HOLDER_HASH];
+					// Lock holders, hashed by pid
+	struct hlist_head holder_files[OSPRD_HOLDER_HASH];
+					// The same, hashed by file
+	struct hlist_head queued_files[OSPRD_HOLDER_HASH];
+					// Waiters queued by OSPRDIOCENQUEUE,
+					//   hashed by file
+	struct rb_root read_ranges;	// Ranges locked for reading
+	struct rb_root write_ranges;	//   and for writing
+	osprd_readers_t *readers;	// Per-CPU fast-path read locks
+	atomic_t task_locks[OSPRD_TASK_HASH];
+					// Locks held, fast or slow, counted
+					//   by hash of the holder's pid
+	int fast_read;			// Fast path open?  Changed with
+					//   d->mutex held; fast readers
+					//   test it under their CPU's
+					//   readers->lock
+	unsigned nwwait;		// Writers waiting for a ticket's turn
+	int lock_policy;		// OSPRD_POLICY_*
+	int read_phase;			// Phase-fair: readers have passed a
+					//   writer since the last write phase
+	unsigned long long nwaits[2];	// Queued lock requests granted,
+	unsigned long long wait_ns[2];	//   and their total wait, indexed
+					//   by write
+	unsigned long long max_wait_ns;	// Longest wait
+	osprd_lockstat_t *lockstat;	// Per-CPU lock instrumentation
+	struct dentry *debugfs_dir;	// osprd/osprdX in debugfs, and its
+	struct dentry *debugfs_stats;	//   files
+	struct dentry *debugfs_reset;
 	
 	// The following elements are used internally; you don't need
 	// to understand them.
@@ -83,8 +508,12 @@ typedef struct osprd_info {
 	struct gendisk *gd;             // The generic disk.
 } osprd_info_t;
 
-#define NOSPRD 4
-static osprd_info_t osprds[NOSPRD];
+/* The devices that exist, indexed by minor number: osprds[0] is
+ * /dev/osprda.  osprd_devices_lock protects the array and each device's
+ * 'users' count; a device can only be destroyed while 'users' is 0. */
+#define OSPRD_MAX_DEVICES 16
+static osprd_info_t *osprds[OSPRD_MAX_DEVICES];
+static DEFINE_MUTEX(osprd_devices_lock);
 
 
 // Declare useful helper functions
@@ -97,118 +526,2740 @@ static osprd_info_t osprds[NOSPRD];
  */
 static osprd_info_t *file2osprd(struct file *filp);
 
-/*
- * for_each_open_file(task, callback, user_data)
- *   Given a task, call the function 'callback' once for each of 'task's open
- *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
- *   the open file, and 'user_data' is copied from for_each_open_file's third
- *   argument.
- */
-static void for_each_open_file(struct task_struct *task,
-			       void (*callback)(struct file *filp,
-						osprd_info_t *user_data),
-			       osprd_info_t *user_data);
+/*
+ * for_each_open_file(task, callback, user_data)
+ *   Given a task, call the function 'callback' once for each of 'task's open
+ *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
+ *   the open file, and 'user_data' is copied from for_each_open_file's third
+ *   argument.
+ */
+static void for_each_open_file(struct task_struct *task,
+			       void (*callback)(struct file *filp,
+						osprd_info_t *user_data),
+			       osprd_info_t *user_data);
+
+
+
+/*
+ * Lock instrumentation hooks.  Each updates this CPU's counters only, and
+ * does nothing but test 'lock_stats' while instrumentation is off.
+ */
+
+static inline unsigned osprd_hist_bucket(unsigned long long ns)
+{
+	unsigned b = (ns >> 32 ? 32 + fls(ns >> 32) : fls(ns));
+	return min(b, OSPRD_HIST_BUCKETS - 1U);
+}
+
+// Count lock 'h' on 'd' as granted, and note when, for its hold time.
+
+static inline void osprd_lockstat_grant(osprd_info_t *d, osprd_holder_t *h)
+{
+	h->since = 0;
+	if (lock_stats) {
+		per_cpu_ptr(d->lockstat, get_cpu())->acquires[h->write]++;
+		put_cpu();
+		h->since = ktime_to_ns(ktime_get());
+	}
+}
+
+// Count lock 'h' on 'd' as released.
+
+static inline void osprd_lockstat_release(osprd_info_t *d, osprd_holder_t *h)
+{
+	osprd_lockstat_t *ls;
+
+	if (!lock_stats)
+		return;
+	ls = per_cpu_ptr(d->lockstat, get_cpu());
+	ls->releases[h->write]++;
+	if (h->since)
+		ls->hold_hist[h->write][osprd_hist_bucket(ktime_to_ns(ktime_get())
+							  - h->since)]++;
+	put_cpu();
+}
+
+// Count a wait of 'ns' nanoseconds for a lock on 'd'.
+
+static inline void osprd_lockstat_wait(osprd_info_t *d, int write,
+				       unsigned long long ns)
+{
+	if (lock_stats) {
+		per_cpu_ptr(d->lockstat, get_cpu())
+			->wait_hist[write][osprd_hist_bucket(ns)]++;
+		put_cpu();
+	}
+}
+
+// Count a lock request on 'd' that returned 'r'.
+
+static inline void osprd_lockstat_result(osprd_info_t *d, int r)
+{
+	osprd_lockstat_t *ls;
+
+	if (!lock_stats || r == 0)
+		return;
+	ls = per_cpu_ptr(d->lockstat, get_cpu());
+	if (r == -EBUSY)
+		ls->try_fails++;
+	else if (r == -EDEADLK)
+		ls->deadlocks++;
+	else if (r == -ERESTARTSYS)
+		ls->interrupts++;
+	else if (r == -ETIMEDOUT)
+		ls->timeouts++;
+	put_cpu();
+}
+
+
+/*
+ * The following helpers maintain the lock bookkeeping.  All are called with
+ * d->mutex held.
+ */
+
+/*
+ * Interval trees.  The kernel's rbtree has no hooks for augmented data, so
+ * after a change every node whose subtree may have changed is recomputed:
+ * the nodes from the deepest one touched up to the root, and their
+ * children.  Every node a rebalancing rotation moves ends up on that path
+ * or as a child of a node on it, with whole subtrees below it, so fixing
+ * each node's children before the node itself, bottom up, is enough.
+ */
+
+static void osprd_range_fix(struct rb_node *rb)
+{
+	osprd_holder_t *h = rb_entry(rb, osprd_holder_t, range_node);
+	unsigned long long max_end = h->end;
+	osprd_holder_t *child;
+
+	if (rb->rb_left) {
+		child = rb_entry(rb->rb_left, osprd_holder_t, range_node);
+		max_end = max(max_end, child->max_end);
+	}
+	if (rb->rb_right) {
+		child = rb_entry(rb->rb_right, osprd_holder_t, range_node);
+		max_end = max(max_end, child->max_end);
+	}
+	h->max_end = max_end;
+}
+
+static void osprd_range_fix_path(struct rb_node *rb)
+{
+	for (; rb; rb = rb_parent(rb)) {
+		if (rb->rb_left)
+			osprd_range_fix(rb->rb_left);
+		if (rb->rb_right)
+			osprd_range_fix(rb->rb_right);
+		osprd_range_fix(rb);
+	}
+}
+
+static void osprd_range_insert(struct rb_root *root, osprd_holder_t *h)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (h->start < rb_entry(parent, osprd_holder_t, range_node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	h->max_end = h->end;
+	rb_link_node(&h->range_node, parent, p);
+	rb_insert_color(&h->range_node, root);
+	osprd_range_fix_path(&h->range_node);
+}
+
+static void osprd_range_erase(struct rb_root *root, osprd_holder_t *h)
+{
+	struct rb_node *rb = &h->range_node, *deepest;
+
+	// Find the deepest node whose subtree rb_erase will change.
+	if (!rb->rb_left && !rb->rb_right)
+		deepest = rb_parent(rb);
+	else if (!rb->rb_right)
+		deepest = rb->rb_left;
+	else if (!rb->rb_left)
+		deepest = rb->rb_right;
+	else {
+		deepest = rb_next(rb);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != rb)
+			deepest = rb_parent(deepest);
+	}
+	rb_erase(rb, root);
+	osprd_range_fix_path(deepest);
+}
+
+// Return true if some range in 'root' overlaps [start, end).
+
+static int osprd_range_overlaps(struct rb_root *root, unsigned long long start,
+				unsigned long long end)
+{
+	struct rb_node *rb = root->rb_node;
+
+	while (rb) {
+		osprd_holder_t *h = rb_entry(rb, osprd_holder_t, range_node);
+		// If any range on the left reaches 'start', either it
+		// overlaps or it and everything after it begins past 'end'.
+		if (rb->rb_left && rb_entry(rb->rb_left, osprd_holder_t,
+					    range_node)->max_end > start)
+			rb = rb->rb_left;
+		else if (h->start >= end)
+			return 0;
+		else if (h->end > start)
+			return 1;
+		else
+			rb = rb->rb_right;
+	}
+	return 0;
+}
+
+// Turn the read fast path on or off: it is on while no write lock is held
+// or waited for.  Once this returns, no fast reader can come in until it
+// is turned back on.
+
+static void osprd_fast_update(osprd_info_t *d)
+{
+	int fast = (d->nwrite == 0 && d->nwwait == 0);
+	int cpu;
+
+	if (fast == d->fast_read)
+		return;
+	d->fast_read = fast;
+	if (fast)
+		return;
+
+	// A fast reader tests fast_read under its CPU's lock, so once each
+	// lock has been taken after the change, every reader that saw the
+	// path open is counted.  One at a time: nesting them all in one
+	// lock class is recursive locking as far as lockdep can tell.
+	for_each_possible_cpu(cpu) {
+		osprd_readers_t *rc = per_cpu_ptr(d->readers, cpu);
+		spin_lock(&rc->lock);
+		spin_unlock(&rc->lock);
+	}
+}
+
+// Return the number of fast-path read locks held.
+
+static unsigned long osprd_fast_count(osprd_info_t *d)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(d->readers, cpu)->count;
+	return count;
+}
+
+// Count a lock taken ('delta' 1) or released ('delta' -1) by 'pid' on 'd'.
+
+static inline void osprd_count_task_lock(osprd_info_t *d, pid_t pid, int delta)
+{
+	atomic_add(delta, &d->task_locks[hash_long(pid, OSPRD_TASK_BITS)]);
+}
+
+// Return false if 'pid' holds no lock on 'd'.  True means it may hold one:
+// another task's pid may hash the same way.  Needs no lock when 'pid' is
+// the caller, since locks are only taken as 'pid' by 'pid' itself (or
+// granted to requests it queued, which it isn't waiting for).
+
+static inline int osprd_task_may_hold(osprd_info_t *d, pid_t pid)
+{
+	return atomic_read(&d->task_locks[hash_long(pid, OSPRD_TASK_BITS)]) != 0;
+}
+
+// Return the fast-path read lock 'pid' holds on 'd', or NULL.  The lists
+// are only searched if d->task_locks says 'pid' may hold a lock at all.
+
+static osprd_holder_t *osprd_find_fast_holder(osprd_info_t *d, pid_t pid)
+{
+	struct hlist_node *pos;
+	osprd_holder_t *h, *found = NULL;
+	int cpu;
+
+	if (!osprd_task_may_hold(d, pid))
+		return NULL;
+	for_each_possible_cpu(cpu) {
+		osprd_readers_t *rc = per_cpu_ptr(d->readers, cpu);
+		spin_lock(&rc->lock);
+		hlist_for_each_entry(h, pos, &rc->holders, pid_link)
+			if (h->pid == pid)
+				found = h;
+		spin_unlock(&rc->lock);
+		if (found)
+			break;
+	}
+	return found;
+}
+
+// Return true if a lock 'h' wants conflicts with a held lock.
+
+static int osprd_range_conflict(osprd_info_t *d, osprd_holder_t *h)
+{
+	return osprd_range_overlaps(&d->write_ranges, h->start, h->end)
+		|| (h->write
+		    && (osprd_range_overlaps(&d->read_ranges, h->start, h->end)
+			|| osprd_fast_count(d) != 0));
+}
+
+// Return the lock 'pid' holds on 'd', or NULL.
+
+static osprd_holder_t *osprd_find_holder(osprd_info_t *d, pid_t pid)
+{
+	struct hlist_head *head = &d->holders[hash_long(pid, OSPRD_HOLDER_BITS)];
+	struct hlist_node *pos;
+	osprd_holder_t *h;
+
+	hlist_for_each_entry(h, pos, head, pid_link)
+		if (h->pid == pid)
+			return h;
+	return NULL;
+}
+
+// Return the lock held on 'd' through 'filp', unless it is a fast-path
+// read lock, or NULL.
+
+static osprd_holder_t *osprd_find_file_holder(osprd_info_t *d,
+					      struct file *filp)
+{
+	struct hlist_head *head = &d->holder_files[hash_ptr(filp, OSPRD_HOLDER_BITS)];
+	struct hlist_node *pos;
+	osprd_holder_t *h;
+
+	hlist_for_each_entry(h, pos, head, filp_link)
+		if (h->filp == filp)
+			return h;
+	return NULL;
+}
+
+// Count lock 'h' as held, and put its range in the matching tree.
+// This and the following helpers are called with osprd_wfg_lock held.
+
+static void osprd_hold(osprd_info_t *d, osprd_holder_t *h)
+{
+	osprd_range_insert(h->write ? &d->write_ranges : &d->read_ranges, h);
+	if (h->write)
+		d->nwrite++;
+	else
+		d->nread++;
+}
+
+// Undo osprd_hold.
+
+static void osprd_unhold(osprd_info_t *d, osprd_holder_t *h)
+{
+	osprd_range_erase(h->write ? &d->write_ranges : &d->read_ranges, h);
+	if (h->write)
+		d->nwrite--;
+	else
+		d->nread--;
+}
+
+// Queue 'w' for lock 'h', at the front of d->waiters or at the back.
+
+static void osprd_enqueue(osprd_info_t *d, osprd_waiter_t *w,
+			  osprd_holder_t *h, int front)
+{
+	w->d = d;
+	w->h = h;
+	w->task = current;
+	w->pid = current->pid;
+	w->visit = 0;
+	if (front)
+		list_add(&w->link, &d->waiters);
+	else
+		list_add_tail(&w->link, &d->waiters);
+	// A queued request doesn't block its task, so it is no edge
+	// in the wait-for graph.
+	if (!w->queued)
+		hlist_add_head(&w->pid_link,
+			       &osprd_waiting[hash_long(w->pid, OSPRD_HOLDER_BITS)]);
+}
+
+// Undo osprd_enqueue.
+
+static void osprd_dequeue(osprd_waiter_t *w)
+{
+	list_del(&w->link);
+	if (!w->queued)
+		hlist_del(&w->pid_link);
+}
+
+/*
+ * Deadlock detection.  Task A waits for task B if B holds a lock that
+ * conflicts with the one A wants, or if B is queued ahead of A on the same
+ * device.  (Under the batch and phase policies a reader may get past B, so
+ * the second kind of edge is conservative.)  A task waits for at most one
+ * lock at a time, so following these edges from the tasks a new request
+ * would wait for, and finding the requesting task again, means a cycle.
+ * The search looks only at tasks reachable that way, each at most once,
+ * and finds the conflicting holders through the interval trees, so it
+ * costs time in proportion to the part of the graph it walks rather than
+ * to the number of locks held.
+ */
+typedef struct osprd_search {
+	pid_t pid;                      // Task making the request
+	unsigned gen;                   // Marks waiters already reached
+	struct list_head queue;         // Waiters reached but not expanded
+	int found;                      // Set if 'pid' was reached
+} osprd_search_t;
+
+// Follow an edge to task 'pid'.
+
+static void osprd_search_task(osprd_search_t *s, pid_t pid)
+{
+	struct hlist_head *head = &osprd_waiting[hash_long(pid, OSPRD_HOLDER_BITS)];
+	struct hlist_node *pos;
+	osprd_waiter_t *w;
+
+	if (pid == s->pid) {
+		s->found = 1;
+		return;
+	}
+	hlist_for_each_entry(w, pos, head, pid_link)
+		if (w->pid == pid) {
+			if (w->visit != s->gen) {
+				w->visit = s->gen;
+				list_add_tail(&w->search_link, &s->queue);
+			}
+			return;
+		}
+}
+
+// Follow edges to the holders of ranges in 'rb's subtree that overlap 'h'.
+
+static void osprd_search_ranges(osprd_search_t *s, struct rb_node *rb,
+				osprd_holder_t *h)
+{
+	while (rb && !s->found) {
+		osprd_holder_t *x = rb_entry(rb, osprd_holder_t, range_node);
+		if (x->max_end <= h->start)
+			return;
+		osprd_search_ranges(s, rb->rb_left, h);
+		if (x->start >= h->end)
+			return;
+		if (x->end > h->start)
+			osprd_search_task(s, x->pid);
+		rb = rb->rb_right;
+	}
+}
+
+// Follow edges from a request for lock 'h' on 'd' queued just before
+// 'pos' in d->waiters.
+
+static void osprd_search_blockers(osprd_search_t *s, osprd_info_t *d,
+				  osprd_holder_t *h, struct list_head *pos)
+{
+	struct list_head *l;
+	int cpu;
+
+	osprd_search_ranges(s, d->write_ranges.rb_node, h);
+	if (h->write) {
+		osprd_search_ranges(s, d->read_ranges.rb_node, h);
+		for_each_possible_cpu(cpu) {
+			osprd_readers_t *rc = per_cpu_ptr(d->readers, cpu);
+			struct hlist_node *hpos;
+			osprd_holder_t *x;
+			spin_lock(&rc->lock);
+			hlist_for_each_entry(x, hpos, &rc->holders, pid_link)
+				osprd_search_task(s, x->pid);
+			spin_unlock(&rc->lock);
+		}
+	}
+	for (l = d->waiters.next; l != pos && !s->found; l = l->next)
+		osprd_search_task(s, list_entry(l, osprd_waiter_t, link)->pid);
+}
+
+// Return 1 if the current task, by waiting for lock 'h' on 'd' from just
+// before 'pos' in d->waiters, would wait for itself.
+
+static int osprd_deadlocked(osprd_info_t *d, osprd_holder_t *h,
+			    struct list_head *pos)
+{
+	osprd_search_t s;
+	osprd_waiter_t *w;
+
+	s.pid = current->pid;
+	s.gen = ++osprd_search_gen;
+	INIT_LIST_HEAD(&s.queue);
+	s.found = 0;
+	osprd_search_blockers(&s, d, h, pos);
+	while (!s.found && !list_empty(&s.queue)) {
+		w = list_entry(s.queue.next, osprd_waiter_t, search_link);
+		list_del(&w->search_link);
+		osprd_search_blockers(&s, w->d, w->h, &w->link);
+	}
+	return s.found;
+}
+
+// Record that task 'h->pid' holds lock 'h' on 'd' through 'filp'.
+
+static void osprd_add_holder(osprd_info_t *d, osprd_holder_t *h,
+			     struct file *filp)
+{
+	h->filp = filp;
+	osprd_hold(d, h);
+	osprd_count_task_lock(d, h->pid, 1);
+	hlist_add_head(&h->pid_link,
+		       &d->holders[hash_long(h->pid, OSPRD_HOLDER_BITS)]);
+	hlist_add_head(&h->filp_link,
+		       &d->holder_files[hash_ptr(filp, OSPRD_HOLDER_BITS)]);
+	filp->f_flags |= F_OSPRD_LOCKED;
+}
+
+// Return true if a queued reader may pass 'writer', which is blocked.
+
+static int osprd_may_pass(osprd_info_t *d, osprd_waiter_t *writer)
+{
+	if (d->lock_policy == OSPRD_POLICY_BATCH)
+		return writer->bypassed < OSPRD_MAX_BYPASS;
+	else if (d->lock_policy == OSPRD_POLICY_PHASE)
+		return !d->read_phase;
+	else
+		return 0;
+}
+
+// Count the wait of 'w', which was just granted, in the statistics.
+
+static void osprd_wait_done(osprd_info_t *d, osprd_waiter_t *w)
+{
+	unsigned long long ns = ktime_to_ns(ktime_sub(ktime_get(), w->start));
+	int write = w->h->write;
+
+	d->nwaits[write]++;
+	d->wait_ns[write] += ns;
+	d->max_wait_ns = max(d->max_wait_ns, ns);
+	osprd_lockstat_wait(d, write, ns);
+}
+
+// Take waiter 'w', which was not granted, off the queue.  The caller must
+// then call osprd_grant, since waiters behind it may be able to go.
+
+static void osprd_unqueue(osprd_info_t *d, osprd_waiter_t *w)
+{
+	spin_lock(&osprd_wfg_lock);
+	osprd_dequeue(w);
+	spin_unlock(&osprd_wfg_lock);
+	d->nwwait -= w->h->write;
+}
+
+/*
+ * osprd_grant(d)
+ *   Hand the lock to the waiters at the front of the queue that can now
+ *   have it: the first one, if it doesn't conflict with a held lock, and
+ *   then each following one that doesn't either (a batch of readers, say).
+ *   Under the batching and phase-fair policies, readers behind a blocked
+ *   writer can also pass it.  Only the tasks granted are woken.
+ */
+static void osprd_grant(osprd_info_t *d)
+{
+	osprd_waiter_t *w, *next, *blocker = NULL;
+	int passed = 0;
+
+	list_for_each_entry_safe(w, next, &d->waiters, link) {
+		// Behind a blocked writer, only readers may go on, and only
+		// if the policy lets them pass it.
+		if (blocker && w->h->write)
+			continue;
+		else if (blocker && !osprd_may_pass(d, blocker))
+			break;
+		if (osprd_range_conflict(d, w->h)) {
+			if (!w->h->write || d->lock_policy == OSPRD_POLICY_FIFO)
+				break;
+			blocker = w;
+			continue;
+		}
+		if (blocker) {
+			blocker->bypassed++;
+			passed = 1;
+		} else if (w->h->write)
+			d->read_phase = 0;
+		d->nwwait -= w->h->write;
+		spin_lock(&osprd_wfg_lock);
+		osprd_dequeue(w);
+		if (w->upgrade)
+			osprd_hold(d, w->h);
+		else {
+			osprd_add_holder(d, w->h, w->filp);
+			osprd_lockstat_grant(d, w->h);
+		}
+		spin_unlock(&osprd_wfg_lock);
+		w->granted = 1;
+		if (w->queued) {
+			osprd_wait_done(d, w);
+			hlist_del(&w->filp_link);
+			w->filp->f_flags &= ~F_OSPRD_QUEUED;
+			kfree(w);
+			wake_up_all(&d->blockq);
+		} else
+			wake_up_process(w->task);
+	}
+	if (passed)
+		d->read_phase = 1;
+	if (list_empty(&d->waiters))
+		d->ticket_tail = d->ticket_head;
+	else
+		d->ticket_tail = list_entry(d->waiters.next, osprd_waiter_t,
+					    link)->ticket;
+	osprd_fast_update(d);
+}
+
+// Release the lock held through 'filp' and hand it on.  Called with
+// d->mutex held, for a lock not taken on the fast path.
+
+static void osprd_release_lock(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h = osprd_find_file_holder(d, filp);
+
+	filp->f_flags &= ~F_OSPRD_LOCKED;
+	if (h) {
+		osprd_lockstat_release(d, h);
+		spin_lock(&osprd_wfg_lock);
+		osprd_unhold(d, h);
+		spin_unlock(&osprd_wfg_lock);
+		osprd_count_task_lock(d, h->pid, -1);
+		hlist_del(&h->pid_link);
+		hlist_del(&h->filp_link);
+		kfree(h);
+	}
+	osprd_grant(d);
+}
+
+/*
+ * osprd_release(d, filp)
+ *   Release the lock held through 'filp'.  Returns -EINVAL if there is
+ *   none.  A fast-path read lock is found through filp->private_data,
+ *   which the block layer leaves to us, and released without d->mutex.
+ */
+static int osprd_release(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h = filp->private_data;
+	int r = 0;
+
+	if (h) {
+		osprd_readers_t *rc = per_cpu_ptr(d->readers, h->cpu);
+		spin_lock(&rc->lock);
+		hlist_del(&h->pid_link);
+		rc->count--;
+		spin_unlock(&rc->lock);
+		filp->private_data = NULL;
+		filp->f_flags &= ~F_OSPRD_LOCKED;
+		osprd_count_task_lock(d, h->pid, -1);
+		osprd_lockstat_release(d, h);
+		kfree(h);
+		// A writer may be waiting for the readers to drain.
+		if (!d->fast_read) {
+			osp_spin_lock(&d->mutex);
+			osprd_grant(d);
+			osp_spin_unlock(&d->mutex);
+		}
+		return 0;
+	}
+
+	osp_spin_lock(&d->mutex);
+	if (!(filp->f_flags & F_OSPRD_LOCKED))
+		r = -EINVAL;
+	else
+		osprd_release_lock(d, filp);
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
+
+// Withdraw the lock request queued through 'filp' by OSPRDIOCENQUEUE.
+// Returns -EINVAL if there is none, because it was granted, say.
+
+static int osprd_cancel(osprd_info_t *d, struct file *filp)
+{
+	struct hlist_head *head = &d->queued_files[hash_ptr(filp, OSPRD_HOLDER_BITS)];
+	struct hlist_node *pos;
+	osprd_waiter_t *w;
+	int r = -EINVAL;
+
+	osp_spin_lock(&d->mutex);
+	hlist_for_each_entry(w, pos, head, filp_link)
+		if (w->filp == filp) {
+			osprd_unqueue(d, w);
+			hlist_del(&w->filp_link);
+			filp->f_flags &= ~F_OSPRD_QUEUED;
+			kfree(w->h);
+			kfree(w);
+			osprd_grant(d);
+			r = 0;
+			break;
+		}
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
+
+// Move the fast-path read lock held through 'filp', if any, to the slow
+// path, so that it can be changed.  Called with d->mutex held.
+
+static void osprd_unfast(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h = filp->private_data;
+	osprd_readers_t *rc;
+
+	if (!h)
+		return;
+	rc = per_cpu_ptr(d->readers, h->cpu);
+	spin_lock(&rc->lock);
+	hlist_del(&h->pid_link);
+	rc->count--;
+	spin_unlock(&rc->lock);
+	filp->private_data = NULL;
+	osprd_count_task_lock(d, h->pid, -1);
+	spin_lock(&osprd_wfg_lock);
+	osprd_add_holder(d, h, filp);
+	spin_unlock(&osprd_wfg_lock);
+}
+
+// Take a whole-device read lock on the fast path, if it is open.  Returns
+// true on success.
+
+static int osprd_fast_acquire(osprd_info_t *d, osprd_holder_t *h,
+			      struct file *filp)
+{
+	int cpu = get_cpu();
+	osprd_readers_t *rc = per_cpu_ptr(d->readers, cpu);
+	int ok;
+
+	spin_lock(&rc->lock);
+	if ((ok = d->fast_read)) {
+		h->pid = current->pid;
+		h->filp = filp;
+		h->cpu = cpu;
+		hlist_add_head(&h->pid_link, &rc->holders);
+		rc->count++;
+		osprd_count_task_lock(d, h->pid, 1);
+		filp->private_data = h;
+		filp->f_flags |= F_OSPRD_LOCKED;
+	}
+	spin_unlock(&rc->lock);
+	put_cpu();
+	if (ok)
+		osprd_lockstat_grant(d, h);
+	return ok;
+}
+
+static struct kmem_cache *osprd_page_cachep;
+
+// Return the shard of d's store that holds page 'idx'.
+
+static inline osprd_shard_t *osprd_shard(osprd_info_t *d, pgoff_t idx)
+{
+	return &d->shards[(idx >> OSPRD_SHARD_SHIFT) & (d->nshards - 1)];
+}
+
+// Return the online node that an interleaved page 'idx' belongs on.
+
+static int osprd_interleave_node(pgoff_t idx)
+{
+	unsigned n = idx % num_online_nodes();
+	int nid;
+
+	for_each_online_node(nid)
+		if (n-- == 0)
+			break;
+	return nid;
+}
+
+/*
+ * osprd_extent_page(shard, gfp)
+ *   Take a page from 'shard's pool of pages split from large extents,
+ *   refilling the pool with a new extent if it is empty and 'gfp' allows
+ *   sleeping.  Extent pages are zeroed and in low memory.  Returns NULL if
+ *   no extent could be had.
+ */
+static struct page *osprd_extent_page(osprd_shard_t *shard, gfp_t gfp)
+{
+	osprd_info_t *d = shard->dev;
+	struct page *page = NULL, *ext;
+	unsigned long flags;
+	int i, node;
+
+	spin_lock_irqsave(&shard->pool_lock, flags);
+	while (list_empty(&shard->pool)) {
+		if (!(gfp & __GFP_WAIT))
+			goto out;
+		if (d->flags & OSPRD_DEV_INTERLEAVE)
+			node = osprd_interleave_node(shard->next_node++);
+		else
+			node = (d->numa_node >= 0 ? d->numa_node : numa_node_id());
+		spin_unlock_irqrestore(&shard->pool_lock, flags);
+
+		ext = alloc_pages_node(node, (gfp & ~__GFP_HIGHMEM) | __GFP_ZERO
+				       | __GFP_NOWARN | __GFP_NORETRY,
+				       OSPRD_EXTENT_ORDER);
+		if (!ext)
+			return NULL;
+		split_page(ext, OSPRD_EXTENT_ORDER);
+
+		spin_lock_irqsave(&shard->pool_lock, flags);
+		for (i = 0; i < (1 << OSPRD_EXTENT_ORDER); i++)
+			list_add_tail(&ext[i].lru, &shard->pool);
+		shard->nextents++;
+	}
+	page = list_entry(shard->pool.next, struct page, lru);
+	list_del(&page->lru);
+ out:
+	spin_unlock_irqrestore(&shard->pool_lock, flags);
+	return page;
+}
+
+/*
+ * osprd_alloc_page(shard, idx, gfp)
+ *   Allocate a page to hold page 'idx' of the store, placing it as the
+ *   device's numa_node, interleave and hugepages settings ask.
+ */
+static struct page *osprd_alloc_page(osprd_shard_t *shard, pgoff_t idx,
+				     gfp_t gfp)
+{
+	osprd_info_t *d = shard->dev;
+	struct page *page;
+
+	if ((d->flags & OSPRD_DEV_HUGEPAGES)
+	    && (page = osprd_extent_page(shard, gfp)))
+		return page;
+	if (d->flags & OSPRD_DEV_INTERLEAVE)
+		return alloc_pages_node(osprd_interleave_node(idx),
+					gfp | __GFP_HIGHMEM, 0);
+	else if (d->numa_node >= 0)
+		return alloc_pages_node(d->numa_node, gfp | __GFP_HIGHMEM, 0);
+	else
+		return alloc_page(gfp | __GFP_HIGHMEM);
+}
+
+static struct task_struct *osprd_spilld;	// see osprd_spill_thread
+
+// Count 'page' in or (if 'delta' is -1) out of 'shard's resident pages,
+// waking osprd_spilld if that puts the shard over budget.  Called with
+// shard->lock held.
+
+static inline void osprd_count_page(osprd_shard_t *shard, struct page *page,
+				    int delta)
+{
+	shard->npages += delta;
+	shard->node_pages[page_to_nid(page) % OSPRD_MAX_NODES] += delta;
+	if (delta > 0 && shard->budget && shard->npages > shard->budget
+	    && osprd_spilld)
+		wake_up_process(osprd_spilld);
+}
+
+#ifdef OSPRD_HAVE_ZLIB
+static z_stream *osprd_inflate_streams;	// per CPU, used with preemption off
+static z_stream osprd_deflate_stream;	// used only by osprd_compressd
+static uint8_t *osprd_zsrc, *osprd_zdst;	// osprd_compressd's buffers
+#endif
+
+/*
+ * osprd_inflate(zdata, zlen, page)
+ *   Decompress the 'zlen' bytes at 'zdata' into 'page'.  Returns 0, or -EIO
+ *   if they do not hold exactly one page.
+ */
+static int osprd_inflate(void *zdata, unsigned zlen, struct page *page)
+{
+#ifdef OSPRD_HAVE_ZLIB
+	z_stream *zs = per_cpu_ptr(osprd_inflate_streams, get_cpu());
+	uint8_t *data_ptr = kmap_atomic(page, KM_USER1);
+	int r;
+
+	zlib_inflateReset(zs);
+	zs->next_in = zdata;
+	zs->avail_in = zlen;
+	zs->next_out = data_ptr;
+	zs->avail_out = PAGE_SIZE;
+	r = zlib_inflate(zs, Z_FINISH);
+	r = (r == Z_STREAM_END && zs->total_out == PAGE_SIZE ? 0 : -EIO);
+	kunmap_atomic(data_ptr, KM_USER1);
+	put_cpu();
+	return r;
+#else
+	return -EIO;
+#endif
+}
+
+// Replace 'pd's compressed data with 'page', which osprd_inflate filled
+// starting at time 'start'.  Called with shard->lock held.
+
+static void osprd_decompressed(osprd_shard_t *shard, osprd_page_t *pd,
+			       struct page *page, ktime_t start)
+{
+	page->index = pd->index;
+	shard->nzpages--;
+	shard->zbytes -= pd->zlen;
+	kfree(pd->zdata);
+	pd->zdata = NULL;
+	pd->zlen = 0;
+	pd->page = page;
+	pd->atime = jiffies;
+	osprd_count_page(shard, page, 1);
+
+	shard->ndecompress++;
+	shard->decompress_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * osprd_decompress(shard, pd)
+ *   Decompress 'pd' back into a freshly allocated page.  Called with
+ *   shard->lock held, so the page is allocated GFP_ATOMIC; callers that
+ *   can sleep call osprd_page_in first instead, which does this outside
+ *   the lock.  Returns 0, or -ENOMEM/-EIO.
+ */
+static int osprd_decompress(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	ktime_t start = ktime_get();
+	struct page *page;
+
+	if (!(page = osprd_alloc_page(shard, pd->index, GFP_ATOMIC)))
+		return -ENOMEM;
+	if (osprd_inflate(pd->zdata, pd->zlen, page) < 0) {
+		eprintk("osprd: corrupt compressed page %lu\n", pd->index);
+		__free_page(page);
+		return -EIO;
+	}
+	osprd_decompressed(shard, pd, page, start);
+	return 0;
+}
+
+/*
+ * osprd_resident_page(shard, pd)
+ *   Return the resident page holding 'pd's data, decompressing it first
+ *   if necessary (or, for an OSPRD_PG_ZERO entry, allocating a zeroed
+ *   page).  Called with shard->lock held.  Returns NULL if the data could
+ *   not be brought back -- including when it is in the spill file, which
+ *   only osprd_spill_in can read.
+ */
+static struct page *osprd_resident_page(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	struct page *page;
+
+	if (pd->flags & OSPRD_PG_SPILLED)
+		return NULL;
+	else if (pd->flags & OSPRD_PG_ZERO) {
+		if (!(page = osprd_alloc_page(shard, pd->index,
+					      GFP_ATOMIC | __GFP_ZERO)))
+			return NULL;
+		page->index = pd->index;
+		pd->page = page;
+		pd->flags &= ~OSPRD_PG_ZERO;
+		osprd_count_page(shard, page, 1);
+	} else if (!pd->page && osprd_decompress(shard, pd) < 0)
+		return NULL;
+	pd->atime = jiffies;
+	pd->flags |= OSPRD_PG_REFERENCED;
+	return pd->page;
+}
+
+// Return true if the 'len' bytes at 'p' are all zero.
+
+static int osprd_is_zero(const uint8_t *p, unsigned len)
+{
+	for (; len > 0 && ((unsigned long) p & (sizeof(long) - 1)); p++, len--)
+		if (*p)
+			return 0;
+	for (; len >= sizeof(long); p += sizeof(long), len -= sizeof(long))
+		if (*(const unsigned long *) p)
+			return 0;
+	for (; len > 0; p++, len--)
+		if (*p)
+			return 0;
+	return 1;
+}
+
+// Hash a page's worth of data for the dedup table.
+
+static u32 osprd_page_csum(const uint8_t *data)
+{
+	return jhash2((const u32 *) data, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/*
+ * osprd_release_page(shard, pd)
+ *   Detach 'pd' from its resident page, freeing the page unless another
+ *   entry still shares it.  Called with shard->lock held.
+ */
+static void osprd_release_page(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	osprd_shared_t *sh = pd->shared;
+
+	if (sh && --sh->refs > 0)
+		shard->nshared--;
+	else {
+		if (sh) {
+			hlist_del(&sh->hash);
+			kfree(sh);
+		}
+		osprd_count_page(shard, pd->page, -1);
+		__free_page(pd->page);
+	}
+	pd->page = NULL;
+	pd->shared = NULL;
+}
+
+/*
+ * osprd_unshare(shard, pd)
+ *   Make 'pd's page private so it can be written: take it out of the dedup
+ *   table and, if other entries use it, give 'pd' its own copy.
+ *   Called with shard->lock held.  Returns 0 or -ENOMEM.
+ */
+static int osprd_unshare(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	osprd_shared_t *sh = pd->shared;
+	struct page *page;
+
+	if (sh->refs == 1) {
+		hlist_del(&sh->hash);
+		kfree(sh);
+		pd->shared = NULL;
+		return 0;
+	}
+
+	if (!(page = osprd_alloc_page(shard, pd->index, GFP_ATOMIC)))
+		return -ENOMEM;
+	copy_highpage(page, pd->page);
+	page->index = pd->index;
+	sh->refs--;
+	shard->nshared--;
+	osprd_count_page(shard, page, 1);
+	pd->page = page;
+	pd->shared = NULL;
+	return 0;
+}
+
+/*
+ * osprd_dedup_find(shard, data, csum)
+ *   Look for a page in the shard's dedup table whose contents equal the page's
+ *   worth of data at 'data'.  Called with shard->lock held.
+ */
+static osprd_shared_t *osprd_dedup_find(osprd_shard_t *shard, const uint8_t *data,
+					u32 csum)
+{
+	struct hlist_head *bucket = &shard->dedup_hash[csum % OSPRD_DEDUP_BUCKETS];
+	struct hlist_node *pos;
+	osprd_shared_t *sh;
+
+	hlist_for_each_entry(sh, pos, bucket, hash) {
+		uint8_t *data_ptr;
+		int same;
+
+		if (sh->csum != csum)
+			continue;
+		data_ptr = kmap_atomic(sh->page, KM_USER1);
+		same = (memcmp(data_ptr, data, PAGE_SIZE) == 0);
+		kunmap_atomic(data_ptr, KM_USER1);
+		if (same)
+			return sh;
+	}
+	return NULL;
+}
+
+// Offer 'pd's private page to the shard's dedup table.  Called with
+// shard->lock held; does nothing if memory is short.
+
+static void osprd_dedup_add(osprd_shard_t *shard, osprd_page_t *pd, u32 csum)
+{
+	osprd_shared_t *sh = kmalloc(sizeof(*sh), GFP_ATOMIC);
+
+	if (!sh)
+		return;
+	sh->csum = csum;
+	sh->refs = 1;
+	sh->page = pd->page;
+	hlist_add_head(&sh->hash, &shard->dedup_hash[csum % OSPRD_DEDUP_BUCKETS]);
+	pd->shared = sh;
+}
+
+// Free a descriptor and its compressed data.  The caller must already
+// have taken it out of the tree with osprd_remove_desc.
+
+static void osprd_free_desc(osprd_page_t *pd)
+{
+	kfree(pd->zdata);
+	kmem_cache_free(osprd_page_cachep, pd);
+}
+
+// Note that 'pd' no longer matches the backing file, if there is one.
+// Called with shard->lock held.
+
+static inline void osprd_mark_dirty(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	if (shard->dev->backing
+	    && !radix_tree_tag_get(&shard->pages, pd->index, OSPRD_TAG_DIRTY)) {
+		radix_tree_tag_set(&shard->pages, pd->index, OSPRD_TAG_DIRTY);
+		shard->ndirty++;
+	}
+}
+
+// Drop 'pd's data, resident or compressed, leaving an OSPRD_PG_ZERO entry
+// that reads as zeros.  Called with shard->lock held.
+
+static void osprd_drop_data(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	if (pd->page)
+		osprd_release_page(shard, pd);
+	else if (pd->flags & OSPRD_PG_SPILLED)
+		shard->nspilled--;
+	else if (pd->zdata) {
+		shard->nzpages--;
+		shard->zbytes -= pd->zlen;
+		kfree(pd->zdata);
+		pd->zdata = NULL;
+		pd->zlen = 0;
+	}
+	pd->flags = OSPRD_PG_ZERO;
+	pd->gen++;
+}
+
+// Take 'pd' out of the shard's tree and drop its data.  Called with
+// shard->lock held.
+
+static void osprd_remove_desc(osprd_shard_t *shard, osprd_page_t *pd)
+{
+	if (radix_tree_tag_get(&shard->pages, pd->index, OSPRD_TAG_DIRTY))
+		shard->ndirty--;
+	radix_tree_delete(&shard->pages, pd->index);
+	osprd_drop_data(shard, pd);
+}
+
+/*
+ * osprd_cow(shard, pd, hole)
+ *   Called before page 'pd' of an origin device changes.  If the device has
+ *   a snapshot or clone that still reads this page through to the origin,
+ *   give it its own copy of the old contents first -- or, if 'hole', an
+ *   OSPRD_PG_ZERO entry, because 'pd' is only now filling a hole.  Called
+ *   with shard->lock held; takes the dependent's shard lock inside it.
+ *   Returns 0 or -ENOMEM.
+ */
+static int osprd_cow(osprd_shard_t *shard, osprd_page_t *pd, int hole)
+{
+	osprd_info_t *d = shard->dev;
+	osprd_shard_t *dshard;
+	osprd_page_t *dpd;
+	struct page *page;
+	int r = 0;
+
+	if (!d->dep || pd->epoch == d->epoch)
+		return 0;
+
+	dshard = osprd_shard(d->dep, pd->index);
+	spin_lock_nested(&dshard->lock, SINGLE_DEPTH_NESTING);
+	if (radix_tree_lookup(&dshard->pages, pd->index))
+		goto done;	// the dependent already has its own version
+
+	r = -ENOMEM;
+	if (!(dpd = kmem_cache_alloc(osprd_page_cachep, GFP_ATOMIC)))
+		goto out;
+	memset(dpd, 0, sizeof(*dpd));
+	dpd->index = pd->index;
+	dpd->atime = jiffies;
+	if (hole)
+		dpd->flags = OSPRD_PG_ZERO;
+	else if (!(page = osprd_resident_page(shard, pd))
+		 || !(dpd->page = osprd_alloc_page(dshard, pd->index, GFP_ATOMIC)))
+		goto nomem;
+	else {
+		copy_highpage(dpd->page, page);
+		dpd->page->index = pd->index;
+	}
+	if (radix_tree_insert(&dshard->pages, pd->index, dpd) < 0) {
+		if (dpd->page)
+			__free_page(dpd->page);
+		goto nomem;
+	}
+	if (dpd->page)
+		osprd_count_page(dshard, dpd->page, 1);
+	dshard->ncow++;
+
+ done:
+	pd->epoch = d->epoch;
+	r = 0;
+	goto out;
+ nomem:
+	osprd_free_desc(dpd);
+ out:
+	spin_unlock(&dshard->lock);
+	return r;
+}
+
+/*
+ * osprd_read_origin(d, idx, page)
+ *   Copy page 'idx' of snapshot or clone 'd's origin into 'page', which
+ *   must already be zeroed.  Returns 0, or -EIO if the origin's data could
+ *   not be brought back.
+ */
+static int osprd_read_origin(osprd_info_t *d, pgoff_t idx, struct page *page)
+{
+	osprd_shard_t *oshard = osprd_shard(d->origin, idx);
+	struct page *opage;
+	osprd_page_t *opd;
+	unsigned long flags;
+	int r = 0;
+
+	spin_lock_irqsave(&oshard->lock, flags);
+	if ((opd = radix_tree_lookup(&oshard->pages, idx))) {
+		if ((opage = osprd_resident_page(oshard, opd)))
+			copy_highpage(page, opage);
+		else
+			r = -EIO;
+	}
+	spin_unlock_irqrestore(&oshard->lock, flags);
+	return r;
+}
+
+/*
+ * osprd_insert_page(d, idx, gfp)
+ *   Make sure page 'idx' of the ramdisk exists, allocating a zeroed page
+ *   with 'gfp' if it does not.  A snapshot or clone's new page starts as a
+ *   copy of its origin's.  Returns 0, or -ENOMEM if out of memory.
+ */
+static int osprd_insert_page(osprd_info_t *d, pgoff_t idx, gfp_t gfp)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	osprd_page_t *pd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	spin_unlock_irqrestore(&shard->lock, flags);
+	if (pd)
+		return 0;
+
+	if (!(pd = kmem_cache_alloc(osprd_page_cachep, gfp)))
+		return -ENOMEM;
+	memset(pd, 0, sizeof(*pd));
+	pd->index = idx;
+	pd->atime = jiffies;
+	if (!(pd->page = osprd_alloc_page(shard, idx, gfp | __GFP_ZERO)))
+		goto nomem;
+	if (radix_tree_preload(gfp)) {
+		__free_page(pd->page);
+		goto nomem;
+	}
+	pd->page->index = idx;
+	// If the origin's page changes after this copy, osprd_cow gives us
+	// the old contents first, and the insert below loses the race.
+	if (d->origin && osprd_read_origin(d, idx, pd->page) < 0) {
+		radix_tree_preload_end();
+		__free_page(pd->page);
+		goto nomem;
+	}
+
+	spin_lock_irqsave(&shard->lock, flags);
+	if (radix_tree_insert(&shard->pages, idx, pd) < 0) {
+		// somebody else got there first
+		spin_unlock_irqrestore(&shard->lock, flags);
+		radix_tree_preload_end();
+		__free_page(pd->page);
+		osprd_free_desc(pd);
+		return 0;
+	}
+	// A hole in an origin is about to be written: its snapshot must
+	// keep reading zeros there.
+	if (osprd_cow(shard, pd, 1) < 0) {
+		radix_tree_delete(&shard->pages, idx);
+		spin_unlock_irqrestore(&shard->lock, flags);
+		radix_tree_preload_end();
+		__free_page(pd->page);
+		goto nomem;
+	}
+	osprd_count_page(shard, pd->page, 1);
+	spin_unlock_irqrestore(&shard->lock, flags);
+	radix_tree_preload_end();
+	return 0;
+
+ nomem:
+	osprd_free_desc(pd);
+	return -ENOMEM;
+}
+
+/*
+ * osprd_store_prepare(d, sector, nbytes, gfp)
+ *   Allocate every page that a write of 'nbytes' bytes at 'sector' will
+ *   touch.  Lets callers that can sleep allocate before entering atomic
+ *   context.  Returns 0 or -ENOMEM.
+ */
+static int osprd_store_prepare(osprd_info_t *d, sector_t sector,
+			       unsigned long nbytes, gfp_t gfp)
+{
+	pgoff_t idx = sector / SECTORS_PER_PAGE;
+	pgoff_t last = (sector + (nbytes - 1) / SECTOR_SIZE) / SECTORS_PER_PAGE;
+
+	for (; idx <= last; idx++)
+		if (osprd_insert_page(d, idx, gfp) < 0)
+			return -ENOMEM;
+	return 0;
+}
+
+/*
+ * osprd_write_page(shard, pd, offset, buf, n)
+ *   Copy 'n' bytes from 'buf' to 'offset' in the page 'pd'.  A write that
+ *   leaves the page all zeros frees it instead, and (with 'dedup') a
+ *   full-page write of data already stored elsewhere in the shard shares
+ *   that page.  If the device has a snapshot, the snapshot gets the old
+ *   contents first.  Called with shard->lock held.  Returns 0, -EIO, or
+ *   -EAGAIN if the page is in the spill file.
+ */
+static int osprd_write_page(osprd_shard_t *shard, osprd_page_t *pd,
+			    unsigned offset, const uint8_t *buf, unsigned n)
+{
+	struct page *page;
+	uint8_t *data_ptr;
+	osprd_shared_t *sh;
+	u32 csum = 0;
+
+	if (pd->flags & OSPRD_PG_SPILLED)
+		return -EAGAIN;
+	if (osprd_cow(shard, pd, 0) < 0
+	    || !(page = osprd_resident_page(shard, pd)))
+		return -EIO;
+
+	// Writing zeros over a page that is otherwise zero: drop the page.
+	if (osprd_is_zero(buf, n) && !(pd->flags & OSPRD_PG_MAPPED)) {
+		int zero;
+		data_ptr = kmap_atomic(page, KM_USER1);
+		zero = osprd_is_zero(data_ptr, offset)
+			&& osprd_is_zero(data_ptr + offset + n,
+					 PAGE_SIZE - offset - n);
+		kunmap_atomic(data_ptr, KM_USER1);
+		if (zero && (shard->dev->origin || shard->dev->backing)) {
+			// a missing page would read the origin's data, or
+			// never reach the backing file
+			osprd_drop_data(shard, pd);
+			osprd_mark_dirty(shard, pd);
+		} else if (zero) {
+			osprd_remove_desc(shard, pd);
+			osprd_free_desc(pd);
+		}
+		if (zero) {
+			shard->nzero++;
+			return 0;
+		}
+	}
+
+	// Rewriting the whole page with data we already have: share it.
+	if (dedup && n == PAGE_SIZE && !(pd->flags & OSPRD_PG_MAPPED)) {
+		csum = osprd_page_csum(buf);
+		if ((sh = osprd_dedup_find(shard, buf, csum))) {
+			if (sh != pd->shared) {
+				osprd_release_page(shard, pd);
+				pd->page = sh->page;
+				pd->shared = sh;
+				sh->refs++;
+				shard->nshared++;
+			}
+			pd->gen++;
+			osprd_mark_dirty(shard, pd);
+			return 0;
+		}
+	}
+
+	if (pd->shared && osprd_unshare(shard, pd) < 0)
+		return -EIO;
+
+	data_ptr = kmap_atomic(pd->page, KM_USER1);
+	if (n == PAGE_SIZE && !((unsigned long) buf & ~PAGE_MASK))
+		copy_page(data_ptr, (void *) buf);
+	else
+		memcpy(data_ptr + offset, buf, n);
+	kunmap_atomic(data_ptr, KM_USER1);
+	pd->gen++;
+	pd->flags &= ~OSPRD_PG_INCOMPRESSIBLE;
+	osprd_mark_dirty(shard, pd);
+
+	if (dedup && n == PAGE_SIZE && !(pd->flags & OSPRD_PG_MAPPED))
+		osprd_dedup_add(shard, pd, csum);
+	return 0;
+}
+
+/*
+ * osprd_transfer(d, sector, buf, nbytes, dir)
+ *   Copy 'nbytes' bytes between the ramdisk, starting at 'sector', and the
+ *   kernel buffer 'buf'.  'dir' is READ or WRITE.
+ *   May be called in atomic context.
+ *   Returns 0 on success, -EIO if the range is past the end of the disk,
+ *   a page could not be allocated, or the device is a read-only snapshot,
+ *   and -EAGAIN if a page must first be read back from the spill file
+ *   (see osprd_transfer_wait).
+ */
+static int osprd_transfer(osprd_info_t *d, sector_t sector, uint8_t *buf,
+			  unsigned long nbytes, int dir)
+{
+	loff_t pos = (loff_t) sector * SECTOR_SIZE;
+	unsigned long flags;
+
+	if (sector + (nbytes / SECTOR_SIZE) > d->nsectors) {
+		eprintk("osprd: access past end of disk (sector %lu)\n",
+			(unsigned long) sector);
+		return -EIO;
+	}
+	if (dir == WRITE && (d->flags & OSPRD_DEV_READONLY))
+		return -EIO;
+
+	while (nbytes > 0) {
+		pgoff_t idx = pos >> PAGE_SHIFT;
+		unsigned offset = pos & ~PAGE_MASK;
+		unsigned n = min_t(unsigned long, nbytes, PAGE_SIZE - offset);
+		// Zeros written to a hole need no page at all -- unless the
+		// hole would show a snapshot's origin through.
+		int zero = (dir == WRITE && !d->origin && osprd_is_zero(buf, n));
+		osprd_shard_t *shard = osprd_shard(d, idx);
+		osprd_shard_t *oshard = NULL;
+		osprd_page_t *pd;
+		struct page *page;
+		uint8_t *data_ptr;
+		int r = 0;
+
+		if (dir == WRITE && !zero
+		    && osprd_insert_page(d, idx, GFP_ATOMIC) < 0)
+			return -EIO;
+
+		// A snapshot reads pages it lacks from its origin.  Lock the
+		// origin's shard first, the same order osprd_cow uses.
+		if (dir == READ && d->origin) {
+			oshard = osprd_shard(d->origin, idx);
+			spin_lock_irqsave(&oshard->lock, flags);
+			spin_lock_nested(&shard->lock, SINGLE_DEPTH_NESTING);
+		} else
+			spin_lock_irqsave(&shard->lock, flags);
+		pd = radix_tree_lookup(&shard->pages, idx);
+		if (!pd && oshard) {
+			pd = radix_tree_lookup(&oshard->pages, idx);
+			shard = oshard;
+		}
+		if (pd && d->ram_limit && !(pd->flags & OSPRD_PG_SPILLED))
+			shard->nhits++;
+		if (pd && dir == WRITE)
+			r = osprd_write_page(shard, pd, offset, buf, n);
+		else if (pd && (pd->flags & OSPRD_PG_SPILLED))
+			r = -EAGAIN;
+		else if (pd && (pd->flags & OSPRD_PG_ZERO))
+			memset(buf, 0, n);
+		else if (pd && (page = osprd_resident_page(shard, pd))) {
+			data_ptr = kmap_atomic(page, KM_USER1);
+			if (n == PAGE_SIZE && !((unsigned long) buf & ~PAGE_MASK))
+				copy_page(buf, data_ptr);
+			else
+				memcpy(buf, data_ptr + offset, n);
+			kunmap_atomic(data_ptr, KM_USER1);
+		} else if (pd)
+			r = -EIO;
+		else if (dir == READ)
+			// a hole: never written, so all zeros
+			memset(buf, 0, n);
+		else
+			shard->nzero++;
+		if (oshard) {
+			spin_unlock(&osprd_shard(d, idx)->lock);
+			spin_unlock_irqrestore(&oshard->lock, flags);
+		} else
+			spin_unlock_irqrestore(&shard->lock, flags);
+
+		if (r < 0)
+			return r;
+		// the page vanished before we could write it; try again
+		if (!pd && dir == WRITE && !zero)
+			continue;
+
+		buf += n;
+		pos += n;
+		nbytes -= n;
+	}
+	return 0;
+}
+
+// Read or write 'len' bytes between kernel buffer 'buf' and offset 'pos' of
+// 'filp'.  Returns 0 or a negative error code; a short transfer is -EIO.
+
+static int osprd_file_io(struct file *filp, void *buf, size_t len,
+			 loff_t pos, int dir)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t r;
+
+	set_fs(KERNEL_DS);
+	if (dir == WRITE)
+		r = vfs_write(filp, (const char __user *) buf, len, &pos);
+	else
+		r = vfs_read(filp, (char __user *) buf, len, &pos);
+	set_fs(old_fs);
+	if (r < 0)
+		return r;
+	return (size_t) r == len ? 0 : -EIO;
+}
+
+/*
+ * osprd_spill_in(d, idx, gfp)
+ *   If page 'idx' of 'd' is in the spill file, read it back into a page
+ *   allocated with 'gfp'.  Must be able to sleep.  Returns 0 or a negative
+ *   error code.
+ */
+static int osprd_spill_in(osprd_info_t *d, pgoff_t idx, gfp_t gfp)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	osprd_page_t *pd;
+	struct page *page;
+	unsigned long flags;
+	unsigned gen = 0;
+	int spilled, r;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if ((spilled = pd && (pd->flags & OSPRD_PG_SPILLED)))
+		gen = pd->gen;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	if (!spilled)
+		return 0;
+
+	if (!(page = osprd_alloc_page(shard, idx, gfp)))
+		return -ENOMEM;
+	r = osprd_file_io(d->spill, kmap(page), PAGE_SIZE,
+			  (loff_t) idx << PAGE_SHIFT, READ);
+	kunmap(page);
+	if (r < 0) {
+		__free_page(page);
+		return r;
+	}
+	page->index = idx;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (pd && (pd->flags & OSPRD_PG_SPILLED) && pd->gen == gen) {
+		pd->page = page;
+		pd->flags = (pd->flags & ~OSPRD_PG_SPILLED) | OSPRD_PG_REFERENCED;
+		pd->atime = jiffies;
+		shard->nspilled--;
+		shard->nmisses++;
+		osprd_count_page(shard, page, 1);
+		page = NULL;
+	}
+	spin_unlock_irqrestore(&shard->lock, flags);
+	if (page)	// somebody else read it back, or it changed
+		__free_page(page);
+	return 0;
+}
+
+/*
+ * osprd_unzip_in(d, idx, gfp)
+ *   If page 'idx' of 'd' is compressed, decompress it into a page allocated
+ *   with 'gfp'.  The compressed data is copied out under the shard lock
+ *   and inflated without it; the result is only installed if nobody wrote
+ *   the page in the meantime.  Must be able to sleep.  Returns 0 or a
+ *   negative error code.
+ */
+static int osprd_unzip_in(osprd_info_t *d, pgoff_t idx, gfp_t gfp)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	ktime_t start = ktime_get();
+	osprd_page_t *pd;
+	struct page *page;
+	unsigned long flags;
+	unsigned gen = 0, zlen = 0;
+	void *zdata;
+	int r;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (pd && pd->zdata)
+		gen = pd->gen, zlen = pd->zlen;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	if (!zlen)
+		return 0;
+
+	if (!(page = osprd_alloc_page(shard, idx, gfp)))
+		return -ENOMEM;
+	if (!(zdata = kmalloc(OSPRD_MAX_ZLEN, gfp))) {
+		__free_page(page);
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (pd && pd->zdata && pd->gen == gen)
+		memcpy(zdata, pd->zdata, (zlen = pd->zlen));
+	else
+		zlen = 0;
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	r = (zlen ? osprd_inflate(zdata, zlen, page) : 0);
+	kfree(zdata);
+	if (r < 0)
+		eprintk("osprd: corrupt compressed page %lu\n", idx);
+	else if (zlen) {
+		spin_lock_irqsave(&shard->lock, flags);
+		pd = radix_tree_lookup(&shard->pages, idx);
+		if (pd && pd->zdata && pd->gen == gen) {
+			osprd_decompressed(shard, pd, page, start);
+			page = NULL;
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+	if (page)	// somebody else decompressed it, or it changed
+		__free_page(page);
+	return r;
+}
+
+/*
+ * osprd_page_in(d, idx, gfp)
+ *   Bring page 'idx' of 'd' back into RAM if it is in the spill file or
+ *   compressed -- and, for a snapshot or clone, the origin's page too,
+ *   since reads fall through to it.  Must be able to sleep.  Returns 0 or
+ *   a negative error code.
+ */
+static int osprd_page_in(osprd_info_t *d, pgoff_t idx, gfp_t gfp)
+{
+	int r = 0;
+
+	if (d->spill)
+		r = osprd_spill_in(d, idx, gfp);
+	if (r == 0 && compress_interval > 0)
+		r = osprd_unzip_in(d, idx, gfp);
+	if (r == 0 && compress_interval > 0 && d->origin)
+		r = osprd_unzip_in(d->origin, idx, gfp);
+	return r;
+}
+
+/*
+ * osprd_transfer_wait(d, sector, buf, nbytes, dir, gfp)
+ *   osprd_transfer for callers that can sleep: pages in the spill file or
+ *   compressed are brought back first, allocating with 'gfp', and the
+ *   transfer is retried if one was evicted again in between.
+ */
+static int osprd_transfer_wait(osprd_info_t *d, sector_t sector, uint8_t *buf,
+			       unsigned long nbytes, int dir, gfp_t gfp)
+{
+	pgoff_t first = sector / SECTORS_PER_PAGE, idx;
+	pgoff_t last = (sector + (nbytes - 1) / SECTOR_SIZE) / SECTORS_PER_PAGE;
+	int r;
+
+	do {
+		for (idx = first, r = 0; idx <= last && r == 0; idx++)
+			r = osprd_page_in(d, idx, gfp);
+		if (r == 0)
+			r = osprd_transfer(d, sector, buf, nbytes, dir);
+	} while (r == -EAGAIN);
+	return r;
+}
+
+// Clear 'len' bytes at 'offset' in page 'idx', if that page exists (or,
+// in a snapshot or clone, if the origin's does).  Returns 0 or -ENOMEM.
+
+static int osprd_clear_partial(osprd_info_t *d, pgoff_t idx,
+			       unsigned offset, unsigned len)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	osprd_page_t *pd;
+	unsigned long flags;
+	int r = 0;
+
+	if (d->origin && osprd_insert_page(d, idx, GFP_KERNEL) < 0)
+		return -ENOMEM;
+	do {
+		if ((r = osprd_page_in(d, idx, GFP_KERNEL)) < 0)
+			return r;
+		spin_lock_irqsave(&shard->lock, flags);
+		pd = radix_tree_lookup(&shard->pages, idx);
+		if (pd)
+			r = osprd_write_page(shard, pd, offset,
+					     page_address(ZERO_PAGE(0)), len);
+		spin_unlock_irqrestore(&shard->lock, flags);
+	} while (r == -EAGAIN);
+	return r < 0 ? -ENOMEM : 0;
+}
+
+/*
+ * osprd_shard_drop(shard, first, last)
+ *   Remove and free every page of 'shard' in [first, last), giving the
+ *   device's snapshot its copies first.  A backed device keeps dirty
+ *   OSPRD_PG_ZERO entries instead, so the flusher zeroes the file there.
+ *   Returns 0, or -ENOMEM if a copy could not be made; the pages from
+ *   there on are left alone.
+ */
+static int osprd_shard_drop(osprd_shard_t *shard, pgoff_t first, pgoff_t last)
+{
+	osprd_page_t *pds[16];
+	unsigned long flags;
+	unsigned i, n;
+	int r = 0;
+
+	while (first < last && r == 0) {
+		unsigned nfree = 0;
+
+		spin_lock_irqsave(&shard->lock, flags);
+		n = radix_tree_gang_lookup(&shard->pages, (void **) pds,
+					   first, ARRAY_SIZE(pds));
+		for (i = 0; i < n && pds[i]->index < last; i++) {
+			if ((r = osprd_cow(shard, pds[i], 0)) < 0)
+				break;
+			if (shard->dev->backing) {
+				osprd_drop_data(shard, pds[i]);
+				osprd_mark_dirty(shard, pds[i]);
+			} else {
+				osprd_remove_desc(shard, pds[i]);
+				pds[nfree++] = pds[i];
+			}
+		}
+		first = (i < n || n == 0) ? last : pds[n - 1]->index + 1;
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		for (i = 0; i < nfree; i++)
+			osprd_free_desc(pds[i]);
+	}
+	return r;
+}
+
+// Make page 'idx' of snapshot or clone 'd' read as zeros, keeping an
+// OSPRD_PG_ZERO entry so that the origin does not show through.
+
+static int osprd_mark_zero(osprd_info_t *d, pgoff_t idx)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	osprd_page_t *pd, *new;
+	unsigned long flags;
+
+	if (!(new = kmem_cache_alloc(osprd_page_cachep, GFP_KERNEL)))
+		return -ENOMEM;
+	memset(new, 0, sizeof(*new));
+	new->index = idx;
+	new->flags = OSPRD_PG_ZERO;
+	new->atime = jiffies;
+	if (radix_tree_preload(GFP_KERNEL)) {
+		osprd_free_desc(new);
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&shard->lock, flags);
+	if ((pd = radix_tree_lookup(&shard->pages, idx)))
+		osprd_drop_data(shard, pd);
+	else if (radix_tree_insert(&shard->pages, idx, new) == 0)
+		new = NULL;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	radix_tree_preload_end();
+
+	if (new)
+		osprd_free_desc(new);
+	return 0;
+}
+
+/*
+ * osprd_zero_range(d, sector, nsect)
+ *   Make 'nsect' sectors starting at 'sector' read as zeros.  Pages entirely
+ *   inside the range are removed from the store and freed; pages that are
+ *   only partly covered are cleared in place.  Used for both discard and
+ *   write-zeroes, which have the same effect on a ramdisk.  In a snapshot
+ *   or clone, full pages become OSPRD_PG_ZERO entries instead.
+ *   Returns 0, or -ENOMEM if copy-on-write ran out of memory partway.
+ */
+static int osprd_zero_range(osprd_info_t *d, sector_t sector, sector_t nsect)
+{
+	loff_t pos = (loff_t) sector * SECTOR_SIZE;
+	loff_t end = pos + (loff_t) nsect * SECTOR_SIZE;
+	pgoff_t first = (pos + PAGE_SIZE - 1) >> PAGE_SHIFT;	// first full page
+	pgoff_t last = end >> PAGE_SHIFT;			// after last full page
+	pgoff_t idx;
+	unsigned i;
+	int r = 0;
+
+	if (first > last)	// the range is inside a single page
+		return osprd_clear_partial(d, pos >> PAGE_SHIFT, pos & ~PAGE_MASK,
+					   end - pos);
+	if (pos & ~PAGE_MASK)
+		r = osprd_clear_partial(d, pos >> PAGE_SHIFT, pos & ~PAGE_MASK,
+					PAGE_SIZE - (pos & ~PAGE_MASK));
+	if (r == 0 && (end & ~PAGE_MASK))
+		r = osprd_clear_partial(d, last, 0, end & ~PAGE_MASK);
+
+	if (d->origin)
+		for (idx = first; idx < last && r == 0; idx++)
+			r = osprd_mark_zero(d, idx);
+	else
+		// Drop the full pages, skipping holes with a gang lookup.
+		for (i = 0; i < d->nshards && r == 0; i++)
+			r = osprd_shard_drop(&d->shards[i], first, last);
+	return r;
+}
+
+// Fill in 'stats' for OSPRDIOCSTATS.
+
+static void osprd_get_stats(osprd_info_t *d, struct osprd_stats *stats)
+{
+	unsigned long flags;
+	unsigned i, j;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->capacity = (unsigned long long) d->nsectors * SECTOR_SIZE;
+	stats->block_size = d->block_size;
+	stats->numa_node = d->numa_node;
+	stats->flags = d->flags;
+	stats->origin = (d->origin ? d->origin->gd->first_minor : -1);
+	stats->ram_limit = d->ram_limit;
+
+	osp_spin_lock(&d->mutex);
+	stats->lock_policy = d->lock_policy;
+	stats->read_waits = d->nwaits[0];
+	stats->read_wait_ns = d->wait_ns[0];
+	stats->write_waits = d->nwaits[1];
+	stats->write_wait_ns = d->wait_ns[1];
+	stats->max_wait_ns = d->max_wait_ns;
+	osp_spin_unlock(&d->mutex);
+
+	for (i = 0; i < d->nshards; i++) {
+		osprd_shard_t *shard = &d->shards[i];
+		spin_lock_irqsave(&shard->lock, flags);
+		stats->used_bytes += ((unsigned long long) shard->npages << PAGE_SHIFT)
+			+ shard->zbytes;
+		stats->compressed_pages += shard->nzpages;
+		stats->compressed_bytes += shard->zbytes;
+		stats->decompressions += shard->ndecompress;
+		stats->decompress_ns += shard->decompress_ns;
+		stats->dedup_saved_bytes += (unsigned long long) shard->nshared << PAGE_SHIFT;
+		stats->zero_writes += shard->nzero;
+		for (j = 0; j < OSPRD_MAX_NODES; j++)
+			stats->node_pages[j] += shard->node_pages[j];
+		stats->cow_copies += shard->ncow;
+		stats->dirty_pages += shard->ndirty;
+		stats->spilled_pages += shard->nspilled;
+		stats->spill_hits += shard->nhits;
+		stats->spill_misses += shard->nmisses;
+		stats->evictions += shard->nevict;
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		spin_lock_irqsave(&shard->pool_lock, flags);
+		stats->huge_extents += shard->nextents;
+		spin_unlock_irqrestore(&shard->pool_lock, flags);
+	}
+
+	if (d->backing) {
+		mutex_lock(&d->flush_mutex);
+		stats->flush_runs = d->nflush_runs;
+		stats->flush_bytes = d->flush_bytes;
+		mutex_unlock(&d->flush_mutex);
+	}
+
+	for_each_possible_cpu(cpu) {
+		osprd_iostat_t *io = per_cpu_ptr(d->iostat, cpu);
+		stats->reads += io->ios[READ];
+		stats->writes += io->ios[WRITE];
+		stats->read_bytes += io->bytes[READ];
+		stats->write_bytes += io->bytes[WRITE];
+	}
+}
+
+/* An image record: a page index followed by a page of data. */
+#define OSPRD_RECORD_SIZE	(sizeof(unsigned long long) + PAGE_SIZE)
+
+/* An image being written: records are gathered in 'buf' and written
+ * OSPRD_IMAGE_BATCH at a time. */
+typedef struct osprd_saver {
+	struct file *filp;
+	uint8_t *buf;
+	unsigned nbuf;			// records in 'buf'
+	loff_t pos;			// file offset for 'buf'
+	unsigned long long npages;	// records written before 'buf'
+} osprd_saver_t;
+
+static int osprd_save_flush(osprd_saver_t *sv)
+{
+	int r = osprd_file_io(sv->filp, sv->buf, sv->nbuf * OSPRD_RECORD_SIZE,
+			      sv->pos, WRITE);
+	sv->pos += sv->nbuf * OSPRD_RECORD_SIZE;
+	sv->npages += sv->nbuf;
+	sv->nbuf = 0;
+	return r;
+}
+
+// Add page 'idx' of 'd' to the image, unless it reads as all zeros.
+
+static int osprd_save_page(osprd_saver_t *sv, osprd_info_t *d, pgoff_t idx)
+{
+	uint8_t *rec = sv->buf + sv->nbuf * OSPRD_RECORD_SIZE;
+	uint8_t *data = rec + sizeof(unsigned long long);
+	sector_t sector = (sector_t) idx * SECTORS_PER_PAGE;
+	unsigned long n;
+
+	if (sector >= d->nsectors)
+		return 0;
+	n = min_t(sector_t, SECTORS_PER_PAGE, d->nsectors - sector) * SECTOR_SIZE;
+	memset(data + n, 0, PAGE_SIZE - n);
+	if (osprd_transfer_wait(d, sector, data, n, READ, GFP_KERNEL) < 0)
+		return -EIO;
+	if (osprd_is_zero(data, n))
+		return 0;
+	*(unsigned long long *) rec = idx;
+	if (++sv->nbuf == OSPRD_IMAGE_BATCH)
+		return osprd_save_flush(sv);
+	return 0;
+}
+
+// Return true if 'd's own store has an entry for page 'idx'.
+
+static int osprd_has_page(osprd_info_t *d, pgoff_t idx)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	unsigned long flags;
+	int r;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	r = radix_tree_lookup(&shard->pages, idx) != NULL;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	return r;
+}
+
+// Save the pages of 'd' that 'shard' holds an entry for.  'shard' belongs
+// to 'd' or, if 'd' is a snapshot, to its origin; then only the pages that
+// 'd' reads through to the origin are saved.
+
+static int osprd_save_shard(osprd_saver_t *sv, osprd_info_t *d,
+			    osprd_shard_t *shard)
+{
+	osprd_page_t *pds[16];
+	pgoff_t idx[16], pos = 0;
+	unsigned long flags;
+	unsigned i, n, nsave;
+	int r = 0;
+
+	do {
+		spin_lock_irqsave(&shard->lock, flags);
+		n = radix_tree_gang_lookup(&shard->pages, (void **) pds,
+					   pos, ARRAY_SIZE(pds));
+		for (i = nsave = 0; i < n; i++)
+			if (!(pds[i]->flags & OSPRD_PG_ZERO))
+				idx[nsave++] = pds[i]->index;
+		if (n > 0)
+			pos = pds[n - 1]->index + 1;
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		for (i = 0; i < nsave && r == 0; i++)
+			if (shard->dev == d || !osprd_has_page(d, idx[i]))
+				r = osprd_save_page(sv, d, idx[i]);
+		cond_resched();
+	} while (n > 0 && r == 0);
+	return r;
+}
+
+/*
+ * osprd_save_image(d, path)
+ *   Write every page of 'd' that is not all zeros to a new image file
+ *   'path'.  Pages written while the save runs may or may not make it into
+ *   the image; save a snapshot to get a consistent one.  Returns 0 or a
+ *   negative error code.
+ */
+static int osprd_save_image(osprd_info_t *d, const char *path)
+{
+	struct osprd_image_header hdr;
+	osprd_saver_t sv;
+	unsigned i;
+	int r = 0;
+
+	memset(&sv, 0, sizeof(sv));
+	if (!(sv.buf = kmalloc(OSPRD_IMAGE_BATCH * OSPRD_RECORD_SIZE, GFP_KERNEL)))
+		return -ENOMEM;
+	sv.filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(sv.filp)) {
+		kfree(sv.buf);
+		return PTR_ERR(sv.filp);
+	}
+	sv.pos = sizeof(hdr);
+
+	// The origin goes first: a page it copies into the snapshot after
+	// its own pass is still found by the snapshot's.
+	if (d->origin)
+		for (i = 0; i < d->origin->nshards && r == 0; i++)
+			r = osprd_save_shard(&sv, d, &d->origin->shards[i]);
+	for (i = 0; i < d->nshards && r == 0; i++)
+		r = osprd_save_shard(&sv, d, &d->shards[i]);
+	if (r == 0 && sv.nbuf)
+		r = osprd_save_flush(&sv);
+
+	// The header goes last, once the number of records is known.
+	if (r == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, OSPRD_IMAGE_MAGIC, sizeof(hdr.magic));
+		hdr.version = OSPRD_IMAGE_VERSION;
+		hdr.page_size = PAGE_SIZE;
+		hdr.size = (unsigned long long) d->nsectors * SECTOR_SIZE;
+		hdr.npages = sv.npages;
+		r = osprd_file_io(sv.filp, &hdr, sizeof(hdr), 0, WRITE);
+	}
+	filp_close(sv.filp, NULL);
+	kfree(sv.buf);
+	return r;
+}
+
+/* One of the threads loading an image: it loads records [first, last). */
+typedef struct osprd_restorer {
+	osprd_info_t *d;
+	struct file *filp;
+	unsigned long long first, last;
+	int r;				// result
+	struct completion done;
+} osprd_restorer_t;
+
+static int osprd_restore_thread(void *arg)
+{
+	osprd_restorer_t *rs = (osprd_restorer_t *) arg;
+	osprd_info_t *d = rs->d;
+	pgoff_t npages = (d->nsectors + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+	unsigned long long rec = rs->first;
+	uint8_t *buf = kmalloc(OSPRD_IMAGE_BATCH * OSPRD_RECORD_SIZE, GFP_KERNEL);
+	int r = (buf ? 0 : -ENOMEM);
+
+	while (rec < rs->last && r == 0) {
+		unsigned i, n = min_t(unsigned long long, OSPRD_IMAGE_BATCH,
+				      rs->last - rec);
+		r = osprd_file_io(rs->filp, buf, n * OSPRD_RECORD_SIZE,
+				  sizeof(struct osprd_image_header)
+				  + rec * OSPRD_RECORD_SIZE, READ);
+		for (i = 0; i < n && r == 0; i++) {
+			uint8_t *p = buf + i * OSPRD_RECORD_SIZE;
+			unsigned long long idx = *(unsigned long long *) p;
+			sector_t sector = (sector_t) idx * SECTORS_PER_PAGE;
+			unsigned long len;
+
+			if (idx >= npages) {
+				r = -EINVAL;
+				break;
+			}
+			len = min_t(sector_t, SECTORS_PER_PAGE,
+				    d->nsectors - sector) * SECTOR_SIZE;
+			r = osprd_store_prepare(d, sector, len, GFP_KERNEL);
+			if (r == 0)
+				r = osprd_transfer_wait(d, sector,
+							p + sizeof(unsigned long long),
+							len, WRITE, GFP_KERNEL);
+		}
+		rec += n;
+		cond_resched();
+	}
+
+	kfree(buf);
+	rs->r = r;
+	complete(&rs->done);
+	return 0;
+}
+
+/*
+ * osprd_restore_image(d, path)
+ *   Replace the contents of 'd' with image file 'path'.  The records are
+ *   split evenly between up to OSPRD_RESTORE_THREADS kernel threads, one
+ *   per online CPU, which load them in parallel.  'd' must not be in use.
+ *   Returns 0 or a negative error code, in which case 'd' is left empty.
+ */
+static int osprd_restore_image(osprd_info_t *d, const char *path)
+{
+	osprd_restorer_t rs[OSPRD_RESTORE_THREADS];
+	struct osprd_image_header hdr;
+	struct task_struct *t;
+	struct file *filp;
+	unsigned i, nthreads;
+	int r;
+
+	filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	r = osprd_file_io(filp, &hdr, sizeof(hdr), 0, READ);
+	if (r == 0 && (memcmp(hdr.magic, OSPRD_IMAGE_MAGIC, sizeof(hdr.magic))
+		       || hdr.version != OSPRD_IMAGE_VERSION
+		       || hdr.page_size != PAGE_SIZE))
+		r = -EINVAL;
+	else if (r == 0 && hdr.size > (unsigned long long) d->nsectors * SECTOR_SIZE)
+		r = -ENOSPC;
+	if (r == 0)
+		r = osprd_zero_range(d, 0, d->nsectors);
+	if (r < 0)
+		goto out;
+
+	nthreads = min_t(unsigned, num_online_cpus(), OSPRD_RESTORE_THREADS);
+	if (hdr.npages < (unsigned long long) nthreads * OSPRD_IMAGE_BATCH)
+		nthreads = 1;
+	for (i = 0; i < nthreads; i++) {
+		rs[i].d = d;
+		rs[i].filp = filp;
+		rs[i].first = hdr.npages * i;
+		do_div(rs[i].first, nthreads);
+		rs[i].last = hdr.npages * (i + 1);
+		do_div(rs[i].last, nthreads);
+		init_completion(&rs[i].done);
+		t = kthread_run(osprd_restore_thread, &rs[i], "osprd_restore/%u", i);
+		if (IS_ERR(t))	// do this share ourselves
+			osprd_restore_thread(&rs[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		wait_for_completion(&rs[i].done);
+		if (rs[i].r < 0 && r == 0)
+			r = rs[i].r;
+	}
+
+	if (r < 0)
+		osprd_zero_range(d, 0, d->nsectors);
+ out:
+	filp_close(filp, NULL);
+	return r;
+}
+
+// Write 'filp's dirty page cache to disk and wait for it, as fsync() does.
+
+static int osprd_file_sync(struct file *filp)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	int r, r2;
+
+	if (!filp->f_op || !filp->f_op->fsync)
+		return -EINVAL;
+	r = filemap_fdatawrite(inode->i_mapping);
+	mutex_lock(&inode->i_mutex);
+	r2 = filp->f_op->fsync(filp, filp->f_dentry, 1);
+	mutex_unlock(&inode->i_mutex);
+	if (r == 0)
+		r = r2;
+	r2 = filemap_fdatawait(inode->i_mapping);
+	return r ? r : r2;
+}
+
+/*
+ * osprd_flush_copy(d, idx, buf)
+ *   Copy page 'idx' of 'd' into 'buf' for writing back, and mark it clean.
+ *   Mapped pages stay dirty, since stores through a mapping don't mark
+ *   them; osprd_vma_nopage marks pages dirty when it maps them writably.
+ *   Returns 0 or -EIO.
+ */
+static int osprd_flush_copy(osprd_info_t *d, pgoff_t idx, uint8_t *buf)
+{
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	osprd_page_t *pd;
+	struct page *page = NULL;
+	unsigned long flags;
+	uint8_t *data_ptr;
+	int r = 0;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (pd && !(pd->flags & OSPRD_PG_ZERO)
+	    && !(page = osprd_resident_page(shard, pd)))
+		r = -EIO;
+	else if (page) {
+		data_ptr = kmap_atomic(page, KM_USER1);
+		copy_page(buf, data_ptr);
+		kunmap_atomic(data_ptr, KM_USER1);
+	} else
+		memset(buf, 0, PAGE_SIZE);
+	if (r == 0 && pd && !(pd->flags & OSPRD_PG_MAPPED)
+	    && radix_tree_tag_clear(&shard->pages, idx, OSPRD_TAG_DIRTY))
+		shard->ndirty--;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	return r;
+}
+
+// After a run of pages has been written back: mark the pages dirty again
+// if the write failed ('err'), and otherwise free the OSPRD_PG_ZERO
+// entries that are still clean, since a hole now matches the file.
+
+static void osprd_flush_done(osprd_info_t *d, pgoff_t first, unsigned n, int err)
+{
+	osprd_shard_t *shard;
+	osprd_page_t *pd;
+	unsigned long flags;
+	pgoff_t idx;
+
+	for (idx = first; idx < first + n; idx++) {
+		shard = osprd_shard(d, idx);
+		spin_lock_irqsave(&shard->lock, flags);
+		pd = radix_tree_lookup(&shard->pages, idx);
+		if (pd && err)
+			osprd_mark_dirty(shard, pd);
+		else if (pd && (pd->flags & OSPRD_PG_ZERO)
+			 && !radix_tree_tag_get(&shard->pages, idx, OSPRD_TAG_DIRTY))
+			osprd_remove_desc(shard, pd);
+		else
+			pd = NULL;
+		spin_unlock_irqrestore(&shard->lock, flags);
+		if (pd && !err)
+			osprd_free_desc(pd);
+	}
+}
+
+// Write back the 'n' dirty pages of 'd' listed in increasing order in 'idx',
+// one run of contiguous pages at a time.  Called with d->flush_mutex held.
+
+static int osprd_flush_pages(osprd_info_t *d, const pgoff_t *idx, unsigned n)
+{
+	loff_t capacity = (loff_t) d->nsectors * SECTOR_SIZE;
+	pgoff_t first = 0;
+	unsigned i, nrun = 0;
+	int r = 0;
+
+	for (i = 0; i <= n && r == 0; i++) {
+		if (nrun && (i == n || idx[i] != first + nrun
+			     || nrun == OSPRD_FLUSH_RUN)) {
+			loff_t pos = (loff_t) first << PAGE_SHIFT;
+			size_t len = min_t(loff_t, nrun << PAGE_SHIFT, capacity - pos);
+			r = osprd_file_io(d->backing, d->flush_buf, len, pos, WRITE);
+			osprd_flush_done(d, first, nrun, r);
+			if (r == 0) {
+				d->nflush_runs++;
+				d->flush_bytes += len;
+			}
+			nrun = 0;
+		}
+		if (i == n || r < 0)
+			break;
+		if (nrun == 0)
+			first = idx[i];
+		r = osprd_page_in(d, idx[i], GFP_KERNEL);
+		if (r == 0)
+			r = osprd_flush_copy(d, idx[i], d->flush_buf
+					     + (nrun << PAGE_SHIFT));
+		if (r < 0)
+			osprd_flush_done(d, first, nrun, r);
+		else
+			nrun++;
+	}
+	return r;
+}
+
+static int osprd_cmp_idx(const void *a, const void *b)
+{
+	pgoff_t x = *(const pgoff_t *) a, y = *(const pgoff_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * osprd_flush_device(d, sync)
+ *   Write every dirty page of backed device 'd' to its file, in increasing
+ *   order and coalesced into runs of up to OSPRD_FLUSH_RUN pages, and then,
+ *   if 'sync', wait for the file to reach the disk.  The dirty pages are
+ *   gathered from all shards OSPRD_FLUSH_WINDOW pages at a time.  Pages
+ *   written meanwhile may be left dirty for the next flush.  Returns 0 or a
+ *   negative error code.
+ */
+static int osprd_flush_device(osprd_info_t *d, int sync)
+{
+	osprd_page_t *pds[16];
+	pgoff_t pos = 0, start, p;
+	unsigned long flags;
+	unsigned i, j, k, n;
+	int r = 0;
+
+	if (!d->backing)
+		return 0;
+
+	mutex_lock(&d->flush_mutex);
+	while (r == 0) {
+		// Find the first dirty page at or after 'pos' ...
+		start = ~0UL;
+		for (i = 0; i < d->nshards; i++) {
+			osprd_shard_t *shard = &d->shards[i];
+			spin_lock_irqsave(&shard->lock, flags);
+			if (radix_tree_gang_lookup_tag(&shard->pages, (void **) pds,
+						       pos, 1, OSPRD_TAG_DIRTY)
+			    && pds[0]->index < start)
+				start = pds[0]->index;
+			spin_unlock_irqrestore(&shard->lock, flags);
+		}
+		if (start == ~0UL)
+			break;
+
+		// ... and every dirty page in the window that it starts.
+		for (i = n = 0; i < d->nshards; i++) {
+			osprd_shard_t *shard = &d->shards[i];
+			p = start;
+			do {
+				spin_lock_irqsave(&shard->lock, flags);
+				k = radix_tree_gang_lookup_tag(&shard->pages,
+							       (void **) pds, p,
+							       ARRAY_SIZE(pds),
+							       OSPRD_TAG_DIRTY);
+				for (j = 0; j < k && pds[j]->index - start < OSPRD_FLUSH_WINDOW; j++)
+					d->flush_idx[n++] = pds[j]->index;
+				if (k > 0)
+					p = pds[k - 1]->index + 1;
+				spin_unlock_irqrestore(&shard->lock, flags);
+			} while (k == ARRAY_SIZE(pds) && j == k);
+		}
+		sort(d->flush_idx, n, sizeof(pgoff_t), osprd_cmp_idx, NULL);
+
+		r = osprd_flush_pages(d, d->flush_idx, n);
+		pos = start + OSPRD_FLUSH_WINDOW;
+		cond_resched();
+	}
+	if (r == 0 && sync)
+		r = osprd_file_sync(d->backing);
+	mutex_unlock(&d->flush_mutex);
+	return r;
+}
+
+// Call 'fn' on every ramdisk in turn, for the background threads.  Each
+// device is held by a reference while 'fn' runs, so it can't be destroyed,
+// but osprd_devices_lock is not held.
+
+static void osprd_for_each_device(void (*fn)(osprd_info_t *d))
+{
+	osprd_info_t *d;
+	unsigned i;
+
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++) {
+		mutex_lock(&osprd_devices_lock);
+		if ((d = osprds[i]))
+			d->users++;
+		mutex_unlock(&osprd_devices_lock);
+		if (!d)
+			continue;
+
+		fn(d);
+
+		mutex_lock(&osprd_devices_lock);
+		d->users--;
+		mutex_unlock(&osprd_devices_lock);
+	}
+}
+
+// The background write-back thread.
+
+static struct task_struct *osprd_flushd;
+
+static void osprd_flush_background(osprd_info_t *d)
+{
+	int r;
+
+	if ((r = osprd_flush_device(d, 0)) < 0)
+		printk(KERN_WARNING "osprd: write-back of osprd%c failed: error %d\n",
+		       'a' + d->gd->first_minor, r);
+}
+
+static int osprd_flush_thread(void *unused)
+{
+	while (!kthread_should_stop()) {
+		osprd_for_each_device(osprd_flush_background);
+		schedule_timeout_interruptible(flush_interval * HZ);
+	}
+	return 0;
+}
+
+/*
+ * osprd_backing_open(d, which)
+ *   Open device 'which's file in 'backing_dir', creating it if necessary,
+ *   and load the file's non-zero pages into 'd'.  Called from
+ *   setup_device, before the disk is visible.  Returns 0 or a negative
+ *   error code.
+ */
+static int osprd_backing_open(osprd_info_t *d, int which)
+{
+	char path[OSPRD_PATH_MAX];
+	struct file *filp;
+	loff_t pos, end, capacity = (loff_t) d->nsectors * SECTOR_SIZE;
+	size_t len, off, n;
+	int r = 0;
+
+	mutex_init(&d->flush_mutex);
+	d->flush_buf = vmalloc(OSPRD_FLUSH_RUN << PAGE_SHIFT);
+	d->flush_idx = kmalloc(OSPRD_FLUSH_WINDOW * sizeof(pgoff_t), GFP_KERNEL);
+	if (!d->flush_buf || !d->flush_idx)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), "%s/osprd%c.dat", backing_dir, 'a' + which);
+	filp = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	// Store holes always match zeros in the file, so only non-zero
+	// pages need loading.
+	end = min_t(loff_t, i_size_read(filp->f_dentry->d_inode), capacity);
+	for (pos = 0; pos < end && r == 0; pos += len) {
+		len = min_t(loff_t, OSPRD_FLUSH_RUN << PAGE_SHIFT, end - pos);
+		r = osprd_file_io(filp, d->flush_buf, len, pos, READ);
+		for (off = 0; off < len && r == 0; off += PAGE_SIZE) {
+			sector_t sector = (pos + off) / SECTOR_SIZE;
+			n = min_t(size_t, PAGE_SIZE, len - off);
+			if (osprd_is_zero(d->flush_buf + off, n))
+				continue;
+			r = osprd_store_prepare(d, sector, n, GFP_KERNEL);
+			if (r == 0)
+				r = osprd_transfer(d, sector, d->flush_buf + off,
+						   n, WRITE);
+		}
+		cond_resched();
+	}
+	if (r < 0) {
+		filp_close(filp, NULL);
+		return r;
+	}
+	// Only now, so that loading did not mark the pages dirty.
+	d->backing = filp;
+	return 0;
+}
+
+// Write back and close d's backing file, if it has one.
+
+static void osprd_backing_close(osprd_info_t *d)
+{
+	int r;
+
+	if (d->backing) {
+		if ((r = osprd_flush_device(d, 1)) < 0)
+			printk(KERN_WARNING "osprd: final write-back of %s failed: error %d\n",
+			       d->gd ? d->gd->disk_name : "osprd", r);
+		filp_close(d->backing, NULL);
+		d->backing = NULL;
+	}
+	vfree(d->flush_buf);
+	kfree(d->flush_idx);
+}
+
+static uint8_t *osprd_spill_buf;	// used only by osprd_spilld
+
+// Return true if 'pd' can be evicted to the spill file right now.  Called
+// with the shard lock held.
+
+static inline int osprd_evictable(osprd_page_t *pd)
+{
+	return pd && pd->page && !pd->shared
+		&& !(pd->flags & (OSPRD_PG_MAPPED | OSPRD_PG_REFERENCED));
+}
+
+/*
+ * osprd_evict_page(d, shard, idx)
+ *   Write page 'idx' to d's spill file and free it.  The page is copied
+ *   out under the shard lock and written without it; it is only freed if
+ *   nobody used it in the meantime.
+ */
+static void osprd_evict_page(osprd_info_t *d, osprd_shard_t *shard, pgoff_t idx)
+{
+	struct page *page = NULL;
+	osprd_page_t *pd;
+	unsigned long flags;
+	uint8_t *data_ptr;
+	unsigned gen;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (!osprd_evictable(pd)) {
+		spin_unlock_irqrestore(&shard->lock, flags);
+		return;
+	}
+	data_ptr = kmap_atomic(pd->page, KM_USER1);
+	memcpy(osprd_spill_buf, data_ptr, PAGE_SIZE);
+	kunmap_atomic(data_ptr, KM_USER1);
+	gen = pd->gen;
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	if (osprd_file_io(d->spill, osprd_spill_buf, PAGE_SIZE,
+			  (loff_t) idx << PAGE_SHIFT, WRITE) < 0)
+		return;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (osprd_evictable(pd) && pd->gen == gen) {
+		page = pd->page;
+		pd->page = NULL;
+		pd->flags |= OSPRD_PG_SPILLED;
+		osprd_count_page(shard, page, -1);
+		shard->nspilled++;
+		shard->nevict++;
+	}
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	if (page)
+		__free_page(page);
+}
+
+/*
+ * osprd_evict_shard(d, shard)
+ *   Evict cold pages from 'shard' until it is back under 7/8 of its
+ *   budget.  This is the CLOCK algorithm: the hand sweeps the shard in
+ *   index order, evicting pages not referenced since it last passed and
+ *   clearing the reference bits of the others, for at most about two turns.
+ */
+static void osprd_evict_shard(osprd_info_t *d, osprd_shard_t *shard)
+{
+	unsigned long target = shard->budget - shard->budget / 8;
+	osprd_page_t *pds[16];
+	pgoff_t idx[16];
+	unsigned long flags;
+	unsigned i, n, ncold, wraps = 0;
+
+	while (shard->npages > target && wraps < 3 && !kthread_should_stop()) {
+		spin_lock_irqsave(&shard->lock, flags);
+		n = radix_tree_gang_lookup(&shard->pages, (void **) pds,
+					   shard->clock_hand, ARRAY_SIZE(pds));
+		for (i = ncold = 0; i < n; i++) {
+			osprd_page_t *pd = pds[i];
+			if (!pd->page || pd->shared || (pd->flags & OSPRD_PG_MAPPED))
+				continue;
+			if (pd->flags & OSPRD_PG_REFERENCED)
+				pd->flags &= ~OSPRD_PG_REFERENCED;	// second chance
+			else
+				idx[ncold++] = pd->index;
+		}
+		if (n > 0)
+			shard->clock_hand = pds[n - 1]->index + 1;
+		else {
+			shard->clock_hand = 0;
+			wraps++;
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		for (i = 0; i < ncold; i++)
+			osprd_evict_page(d, shard, idx[i]);
+		cond_resched();
+	}
+}
+
+// The eviction thread.  osprd_count_page wakes it when a shard goes over
+// budget; it also looks once a second.
+
+static void osprd_evict_device(osprd_info_t *d)
+{
+	unsigned i;
+
+	for (i = 0; d->spill && i < d->nshards; i++)
+		if (d->shards[i].budget
+		    && d->shards[i].npages > d->shards[i].budget)
+			osprd_evict_shard(d, &d->shards[i]);
+}
 
+static int osprd_spill_thread(void *unused)
+{
+	while (!kthread_should_stop()) {
+		osprd_for_each_device(osprd_evict_device);
+		schedule_timeout_interruptible(HZ);
+	}
+	return 0;
+}
 
+// Create d's spill file in 'spill_dir' and give each shard its share of
+// the RAM budget.  Called from setup_device.
 
-/* helper function we write ourselves */
-/* return a valid ticket to assign to ticket tail */
+static int osprd_spill_open(osprd_info_t *d, int which)
+{
+	char path[OSPRD_PATH_MAX];
+	unsigned long pages = d->ram_limit >> PAGE_SHIFT;
+	unsigned i;
 
-unsigned return_valid_ticket (node_t* invalid_tickets, unsigned ticket) {
-	//none in queue
-	node_t *itr;
-	if(invalid_tickets->val == -1) {
-		return ticket;
+	snprintf(path, sizeof(path), "%s/osprd%c.spill", spill_dir, 'a' + which);
+	d->spill = filp_open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(d->spill)) {
+		int r = PTR_ERR(d->spill);
+		d->spill = NULL;
+		return r;
 	}
-	itr = invalid_tickets;
+	for (i = 0; i < d->nshards; i++)
+		d->shards[i].budget = max(pages / d->nshards, 1UL);
+	return 0;
+}
 
-	while (itr != NULL)
-	{
-		if (itr->val == ticket)
-			return return_valid_ticket(invalid_tickets, ticket+1);
-		itr = itr->next;
-	}
-	return ticket;
-}
-
-/* add tickets to invalid tickets */
-void add_to_ticket_list(node_t *invalid_tickets, unsigned ticket) {
-	//head node
-	node_t *itr;
-	node_t *addMe;
-	//no node present
-	if(invalid_tickets->val == -1) {
-		invalid_tickets->val = ticket;
-		invalid_tickets->next = NULL;
+#ifdef OSPRD_HAVE_ZLIB
+/*
+ * osprd_compress_page(shard, idx)
+ *   Compress page 'idx' of 'shard' if it is still cold.  The page is copied
+ *   out under the shard lock and compressed without it; the result is only
+ *   installed if nobody wrote the page in the meantime.
+ */
+static void osprd_compress_page(osprd_shard_t *shard, pgoff_t idx)
+{
+	unsigned long cold = compress_interval * HZ;
+	z_stream *zs = &osprd_deflate_stream;
+	struct page *page = NULL;
+	void *zdata = NULL;
+	osprd_page_t *pd;
+	unsigned long flags;
+	uint8_t *data_ptr;
+	unsigned gen;
+	int r;
+
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (!pd || !pd->page || pd->shared || (pd->flags & OSPRD_PG_MAPPED)
+	    || time_before(jiffies, pd->atime + cold)) {
+		spin_unlock_irqrestore(&shard->lock, flags);
 		return;
 	}
-	//iterator
-	itr = invalid_tickets;
+	data_ptr = kmap_atomic(pd->page, KM_USER1);
+	memcpy(osprd_zsrc, data_ptr, PAGE_SIZE);
+	kunmap_atomic(data_ptr, KM_USER1);
+	gen = pd->gen;
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	zlib_deflateReset(zs);
+	zs->next_in = osprd_zsrc;
+	zs->avail_in = PAGE_SIZE;
+	zs->next_out = osprd_zdst;
+	zs->avail_out = OSPRD_MAX_ZLEN;
+	r = zlib_deflate(zs, Z_FINISH);
+	if (r == Z_STREAM_END && (zdata = kmalloc(zs->total_out, GFP_KERNEL)))
+		memcpy(zdata, osprd_zdst, zs->total_out);
 
-	while(itr->next != NULL) {
-		itr = itr->next;
+	spin_lock_irqsave(&shard->lock, flags);
+	pd = radix_tree_lookup(&shard->pages, idx);
+	if (!pd || !pd->page || pd->shared || pd->gen != gen
+	    || time_before(jiffies, pd->atime + cold))
+		/* written or read since we looked; leave it */;
+	else if (r != Z_STREAM_END)
+		pd->flags |= OSPRD_PG_INCOMPRESSIBLE;
+	else if (zdata) {
+		page = pd->page;
+		pd->page = NULL;
+		pd->zdata = zdata;
+		pd->zlen = zs->total_out;
+		osprd_count_page(shard, page, -1);
+		shard->nzpages++;
+		shard->zbytes += pd->zlen;
+		zdata = NULL;
 	}
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	if (page)
+		__free_page(page);
+	kfree(zdata);
+}
 
-	//itr->next is a nullptr. create a new node at the end.
-	addMe = (node_t *) kmalloc(sizeof (node_t*), GFP_ATOMIC);
-	itr->next = addMe;
-	addMe->val = ticket;
-	addMe->next = NULL;
+// Compress every cold page of 'shard'.
 
-	return;
+static void osprd_compress_cold(osprd_shard_t *shard)
+{
+	unsigned long cold = compress_interval * HZ;
+	osprd_page_t *pds[16];
+	pgoff_t idx[16];
+	pgoff_t pos = 0;
+	unsigned long flags;
+	unsigned i, n, ncold;
+
+	do {
+		spin_lock_irqsave(&shard->lock, flags);
+		n = radix_tree_gang_lookup(&shard->pages, (void **) pds,
+					   pos, ARRAY_SIZE(pds));
+		for (i = ncold = 0; i < n; i++)
+			if (pds[i]->page && !pds[i]->shared
+			    && !(pds[i]->flags & (OSPRD_PG_INCOMPRESSIBLE
+						  | OSPRD_PG_MAPPED))
+			    && time_after_eq(jiffies, pds[i]->atime + cold))
+				idx[ncold++] = pds[i]->index;
+		if (n > 0)
+			pos = pds[n - 1]->index + 1;
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		for (i = 0; i < ncold; i++)
+			osprd_compress_page(shard, idx[i]);
+		cond_resched();
+	} while (n > 0 && !kthread_should_stop());
 }
 
-/* add pid to list of pids with locks */
-void add_to_pid_list(node_t *pid_list, unsigned pid) {
-	//declare vars
-	node_t *itr;
-	node_t *addMe;
+// The background compression thread.
 
-	itr = pid_list;
-	addMe = (node_t*) kmalloc(sizeof(node_t*), GFP_ATOMIC);
-	addMe->val = pid;
+static struct task_struct *osprd_compressd;
 
-	if (pid_list->val == -1) { // head node
-		pid_list->val = pid;
-		pid_list->next = NULL;
-		return;
-	}
+static void osprd_compress_device(osprd_info_t *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->nshards; i++)
+		osprd_compress_cold(&d->shards[i]);
+}
 
-	while(itr->next != NULL) {
-		itr = itr->next;
+static int osprd_compress_thread(void *unused)
+{
+	while (!kthread_should_stop()) {
+		osprd_for_each_device(osprd_compress_device);
+		schedule_timeout_interruptible(compress_interval * HZ);
 	}
-	itr->next = addMe;
+	return 0;
+}
 
+static void osprd_compress_stop(void)
+{
+	if (osprd_compressd)
+		kthread_stop(osprd_compressd);
+	osprd_compressd = NULL;
 }
 
-void remove_from_list(node_t *node, unsigned value) {
-	node_t *itr = node;
-	node_t *removeMe;
-	//empty list
-	if(node->val == -1) {
-		return;
+// Free the zlib streams.  Pages may still be compressed, and saving or
+// flushing them inflates them, so this runs after the devices are gone.
+
+static void osprd_compress_exit(void)
+{
+	int cpu;
+
+	osprd_compress_stop();
+	if (osprd_inflate_streams) {
+		for_each_possible_cpu(cpu)
+			vfree(per_cpu_ptr(osprd_inflate_streams, cpu)->workspace);
+		free_percpu(osprd_inflate_streams);
+		osprd_inflate_streams = NULL;
 	}
-	//only one in list, set value to -1 to indicate empty.
-	if(node->next == NULL) {
-		node->val = -1;
-		node->next = NULL;
-		return;
+	if (osprd_deflate_stream.workspace) {
+		zlib_deflateEnd(&osprd_deflate_stream);
+		vfree(osprd_deflate_stream.workspace);
+		osprd_deflate_stream.workspace = NULL;
 	}
+	kfree(osprd_zsrc);
+	kfree(osprd_zdst);
+	osprd_zsrc = osprd_zdst = NULL;
+}
 
-	while(itr!= NULL) {
-		if(itr->next != NULL && itr->next->val == value) {
-			break;
-		}
-		itr = itr->next;
+// Set up the zlib streams and start the compression thread.
+
+static int osprd_compress_init(void)
+{
+	z_stream *zs;
+	int cpu;
+
+	if (!(osprd_inflate_streams = alloc_percpu(z_stream)))
+		goto nomem;
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(osprd_inflate_streams, cpu);
+		if (!(zs->workspace = vmalloc(zlib_inflate_workspacesize())))
+			goto nomem;
+		zlib_inflateInit(zs);
 	}
-	//not in the list
-	if(itr == NULL) {
-		return;
+
+	zs = &osprd_deflate_stream;
+	if (!(zs->workspace = vmalloc(zlib_deflate_workspacesize())))
+		goto nomem;
+	zlib_deflateInit(zs, Z_BEST_SPEED);
+
+	osprd_zsrc = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	osprd_zdst = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!osprd_zsrc || !osprd_zdst)
+		goto nomem;
+
+	osprd_compressd = kthread_run(osprd_compress_thread, NULL, "osprd_compressd");
+	if (IS_ERR(osprd_compressd)) {
+		osprd_compressd = NULL;
+		goto nomem;
 	}
+	return 0;
+
+ nomem:
+	osprd_compress_exit();
+	return -ENOMEM;
+}
+#else
+static int osprd_compress_init(void)
+{
+	printk(KERN_WARNING "osprd: compress_interval needs a kernel with zlib\n");
+	return -EINVAL;
+}
+
+static void osprd_compress_stop(void)
+{
+}
 
-	removeMe = itr->next;
-	itr->next = removeMe->next;
-	kfree(removeMe);
+static void osprd_compress_exit(void)
+{
+}
+#endif
+
+// Count one request of 'nbytes' bytes in direction 'dir' on this CPU.
+
+static inline void osprd_account(osprd_info_t *d, int dir, unsigned long nbytes)
+{
+	osprd_iostat_t *io = per_cpu_ptr(d->iostat, get_cpu());
+	io->ios[dir]++;
+	io->bytes[dir] += nbytes;
+	put_cpu();
 }
 
 /*
@@ -218,9 +3269,12 @@ void remove_from_list(node_t *node, unsigned value) {
  */
 static void osprd_process_request(osprd_info_t *d, struct request *req)
 {
-	//declare vars
-	unsigned request_type;
-	uint8_t *data_ptr;
+	sector_t sector = req->sector;
+	int dir = rq_data_dir(req);
+	struct bio_vec *bvec;
+	struct bio *bio;
+	unsigned long flags;
+	int i, r = 0;
 
 	if (!blk_fs_request(req)) {
 		end_request(req, 0);
@@ -235,29 +3289,68 @@ static void osprd_process_request(osprd_info_t *d, struct request *req)
 	// 'req->buffer' members, and the rq_data_dir() function.
 
 	// Your code here.
-/*	if(req->sector + req->current_nr_sectors > nsectors) {
-		eprintk("Printing to sector that is out of range\n");
-		end_request(req, 0);
+	// Copy every segment of every bio in the request, then complete the
+	// whole request at once rather than one segment at a time.  The
+	// queue lock is held with interrupts off, so map each segment with
+	// bvec_kmap_irq's slot; the store uses KM_USER0/1.
+	rq_for_each_bio(bio, req) {
+		bio_for_each_segment(bvec, bio, i) {
+			uint8_t *buf = (uint8_t *) bvec_kmap_irq(bvec, &flags);
+			r = osprd_transfer(d, sector, buf, bvec->bv_len, dir);
+			bvec_kunmap_irq((char *) buf, &flags);
+			if (r < 0)
+				goto done;
+			sector += bvec->bv_len / SECTOR_SIZE;
+		}
 	}
-*/
-	// Your code here.
-	//vars declared above.
+	osprd_account(d, dir, req->hard_nr_sectors * SECTOR_SIZE);
 
-	request_type = 	rq_data_dir(req);
-	// d->data is the beginning address of a sector 
-	data_ptr = d->data + (req->sector * SECTOR_SIZE);
-
-	if(request_type == READ) {
-		memcpy((void*) req->buffer, (void*) data_ptr, req->current_nr_sectors * SECTOR_SIZE);
-	}
-	else if (request_type == WRITE) {
-		memcpy((void*) data_ptr, (void*) req->buffer, req->current_nr_sectors * SECTOR_SIZE);
+ done:
+	if (!end_that_request_first(req, r == 0, req->hard_nr_sectors)) {
+		blkdev_dequeue_request(req);
+		end_that_request_last(req, r == 0);
 	}
-	// not read or write request 
-	else {		
-		end_request(req, 0);
+}
+
+/*
+ * osprd_make_request(q, bio)
+ *   Used instead of the request queue when queue_mode is OSPRD_QUEUE_BIO
+ *   or OSPRD_QUEUE_MQ.  Copies every segment of 'bio' and completes it
+ *   once, without going through the elevator.  Runs on the submitting CPU,
+ *   so with per-CPU shards concurrent submitters rarely share a lock.
+ */
+static int osprd_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+	sector_t sector = bio->bi_sector;
+	int dir = bio_data_dir(bio);
+	struct bio_vec *bvec;
+	int i, r = 0;
+
+	bio_for_each_segment(bvec, bio, i) {
+		// kmap, not kmap_atomic: we may sleep allocating pages, and
+		// the store needs both atomic slots for its own copies
+		uint8_t *buf = (uint8_t *) kmap(bvec->bv_page) + bvec->bv_offset;
+
+		// allocate now, while we can still sleep
+		if (dir == WRITE && !osprd_is_zero(buf, bvec->bv_len))
+			r = osprd_store_prepare(d, sector, bvec->bv_len, GFP_NOIO);
+		if (r == 0)
+			r = osprd_transfer_wait(d, sector, buf, bvec->bv_len,
+						dir, GFP_NOIO);
+		kunmap(bvec->bv_page);
+		if (r < 0)
+			break;
+		sector += bvec->bv_len / SECTOR_SIZE;
 	}
-	end_request(req, 1); 
+
+	// A barrier is a durability point: write back everything first.
+	if (r == 0 && bio_barrier(bio))
+		r = osprd_flush_device(d, 1);
+	if (r == 0)
+		osprd_account(d, dir, bio->bi_size);
+	bio_endio(bio, bio->bi_size, r);
+	return 0;
 }
 
 
@@ -277,35 +3370,16 @@ static int osprd_open(struct inode *inode, struct file *filp)
 // last copy is closed.)
 static int osprd_close_last(struct inode *inode, struct file *filp)
 {
-	//declare vars
-	int lock_check;
-
 	if (filp) {
 		osprd_info_t *d = file2osprd(filp);
 		int filp_writable = filp->f_mode & FMODE_WRITE;
 
-		// EXERCISE: If the user closes a ramdisk file that holds
-		// a lock, release the lock.  Also wake up blocked processes
-		// as appropriate.
-
-		// Your code here.
-		//set spin lock 
-		osp_spin_lock(&(d->mutex));
-		lock_check = (filp->f_flags | F_OSPRD_LOCKED);
-		//if true, it means it is locked.
-		if(filp->f_flags == lock_check) {
-			filp->f_flags = (filp->f_flags & (~F_OSPRD_LOCKED)); //gets rid of just osprd_locked flag
-			if (filp_writable) {		//remove from write list
-				remove_from_list(d->write_locking_pids, current->pid);	//TODO: current pid?
-				d->nwrite--;
-			}
-			else {						//remove from read list
-				remove_from_list(d->read_locking_pids, current->pid); //TODO: current pid?
-				d->nread--;
-			}
-			wake_up_all(&(d->blockq));
-		}
-		osp_spin_unlock(&(d->mutex));
+		// If the user closes a ramdisk file that holds a lock,
+		// release the lock.  A queued request goes too.
+		if (filp->f_flags & F_OSPRD_LOCKED)
+			osprd_release(d, filp);
+		else if (filp->f_flags & F_OSPRD_QUEUED)
+			osprd_cancel(d, filp);
 		// This line avoids compiler warnings; you may remove it.
 		(void) filp_writable, (void) d;
 
@@ -315,9 +3389,342 @@ static int osprd_close_last(struct inode *inode, struct file *filp)
 }
 
 
+// Start the wait of 'w', just queued with osprd_enqueue: it may be
+// granted at once.
+
+static void osprd_start_wait(osprd_info_t *d, osprd_waiter_t *w)
+{
+	w->granted = 0;
+	w->bypassed = 0;
+	w->start = ktime_get();
+	if (w->h->write) {
+		d->nwwait++;
+		osprd_fast_update(d);
+	}
+	osprd_grant(d);
+}
+
+/*
+ * osprd_wait(d, w, h, timeout)
+ *   Wait for lock 'h', for which 'w' was queued with osprd_enqueue, and
+ *   sleep until osprd_grant hands the lock over, a signal arrives, or
+ *   'timeout' jiffies pass.  Called with d->mutex held, and returns with it
+ *   held.  Returns 0 if the lock was granted; otherwise 'w' is off the
+ *   queue again, and the caller must call osprd_grant.
+ */
+static int osprd_wait(osprd_info_t *d, osprd_waiter_t *w, osprd_holder_t *h,
+		      long timeout)
+{
+	osprd_start_wait(d, w);
+	osp_spin_unlock(&d->mutex);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (w->granted || signal_pending(current) || timeout == 0)
+			break;
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	// Even a granted waiter takes d->mutex, so that it can't return
+	// (and free 'w') while osprd_grant is still using it.
+	osp_spin_lock(&d->mutex);
+	if (!w->granted) {
+		osprd_unqueue(d, w);
+		return (signal_pending(current) ? -ERESTARTSYS : -ETIMEDOUT);
+	}
+	osprd_wait_done(d, w);
+	return 0;
+}
+
+/*
+ * osprd_acquire(d, filp, start, end, try, timeout)
+ *   Lock bytes [start, end) of 'd' through 'filp': a write lock if 'filp'
+ *   is open for writing, otherwise a read lock.  Requests are served in
+ *   ticket order, so a request waits for every earlier one, even one for
+ *   a range that doesn't overlap.  If 'try', returns -EBUSY instead of
+ *   blocking or deadlocking.  A blocked request sleeps until osprd_grant
+ *   hands it the lock, or for at most 'timeout' jiffies
+ *   (MAX_SCHEDULE_TIMEOUT for no limit), after which it gives up its place
+ *   and returns -ETIMEDOUT.  A request that would wait, through other
+ *   tasks, for a lock the caller holds on any device returns -EDEADLK.
+ */
+static int osprd_acquire(osprd_info_t *d, struct file *filp,
+			 unsigned long long start, unsigned long long end,
+			 int try, long timeout)
+{
+	osprd_holder_t *h;
+	osprd_waiter_t w;
+	int r = 0;
+
+	if (!(h = kmalloc(sizeof(*h), GFP_KERNEL)))
+		return -ENOMEM;
+	h->pid = current->pid;
+	h->write = (filp->f_mode & FMODE_WRITE) != 0;
+	h->start = start;
+	h->end = end;
+
+	// A read lock of the whole device needs no ticket while no writer
+	// is around: it can't conflict with anything.  A task that may hold
+	// a lock already goes the slow way, to get -EDEADLK if it does.
+	if (!h->write && start == 0 && end == ~0ULL
+	    && !(filp->f_flags & (F_OSPRD_LOCKED | F_OSPRD_QUEUED))
+	    && !osprd_task_may_hold(d, current->pid)
+	    && osprd_fast_acquire(d, h, filp))
+		return 0;
+
+	w.filp = filp;
+	w.upgrade = 0;
+	w.queued = 0;
+	osp_spin_lock(&d->mutex);
+	// A task that already holds a lock would wait for itself.
+	if ((filp->f_flags & (F_OSPRD_LOCKED | F_OSPRD_QUEUED))
+	    || osprd_find_holder(d, current->pid)
+	    || osprd_find_fast_holder(d, current->pid))
+		r = (try ? -EBUSY : -EDEADLK);
+	else if (try) {
+		// No ticket is needed: the lock is only free to take if
+		// nobody is waiting for it.  A writer must shut out fast
+		// readers to be sure none holds the lock.
+		d->nwwait += h->write;
+		osprd_fast_update(d);
+		d->nwwait -= h->write;
+		if (!list_empty(&d->waiters) || osprd_range_conflict(d, h))
+			r = -EBUSY;
+		else {
+			spin_lock(&osprd_wfg_lock);
+			osprd_add_holder(d, h, filp);
+			spin_unlock(&osprd_wfg_lock);
+			osprd_lockstat_grant(d, h);
+			h = NULL;
+		}
+		osprd_fast_update(d);
+	} else {
+		// Checking and queueing under one hold of osprd_wfg_lock
+		// means that, of two requests closing a cycle together, the
+		// second sees the first.
+		spin_lock(&osprd_wfg_lock);
+		if (osprd_deadlocked(d, h, &d->waiters))
+			r = -EDEADLK;
+		else
+			osprd_enqueue(d, &w, h, 0);
+		spin_unlock(&osprd_wfg_lock);
+	}
+	if (r < 0 || !h) {
+		osp_spin_unlock(&d->mutex);
+		kfree(h);
+		return r;
+	}
+
+	w.ticket = d->ticket_head++;
+	r = osprd_wait(d, &w, h, timeout);
+	if (r < 0)
+		// Waiters behind this one may be able to go now.
+		osprd_grant(d);
+	osp_spin_unlock(&d->mutex);
+	if (r < 0)
+		kfree(h);
+	return r;
+}
+
+/* One of the locks an OSPRDIOCACQUIREMULTI takes. */
+typedef struct osprd_multi {
+	osprd_info_t *d;
+	struct file *filp;
+} osprd_multi_t;
+
+static int osprd_multi_cmp(const void *a, const void *b)
+{
+	return ((const osprd_multi_t *) a)->d->gd->first_minor
+		- ((const osprd_multi_t *) b)->d->gd->first_minor;
+}
+
+/*
+ * osprd_acquire_multi(set, try)
+ *   Lock the whole of every device open as one of the files in 'set'.
+ *   The devices are locked in order of minor number, so two such requests
+ *   can't deadlock on each other however their sets are ordered.  If any
+ *   lock fails -- if 'try' and a device is busy, for instance -- the locks
+ *   already taken are released, and nothing is held on return.
+ */
+static int osprd_acquire_multi(struct osprd_fdset *set, int try)
+{
+	osprd_multi_t locks[OSPRD_MAX_FDSET];
+	unsigned i, n;
+	int r = 0;
+
+	if (set->count == 0 || set->count > OSPRD_MAX_FDSET)
+		return -EINVAL;
+	for (n = 0; n < set->count; n++) {
+		if (!(locks[n].filp = fget(set->fds[n]))) {
+			r = -EBADF;
+			goto out;
+		} else if (!(locks[n].d = file2osprd(locks[n].filp))) {
+			fput(locks[n].filp);
+			r = -EINVAL;
+			goto out;
+		}
+	}
+
+	sort(locks, n, sizeof(locks[0]), osprd_multi_cmp, NULL);
+	// A second lock on one device would wait for the first.
+	for (i = 1; i < n; i++)
+		if (locks[i].d == locks[i - 1].d) {
+			r = -EINVAL;
+			goto out;
+		}
+	for (i = 0; i < n; i++)
+		if ((r = osprd_acquire(locks[i].d, locks[i].filp, 0, ~0ULL,
+				       try, MAX_SCHEDULE_TIMEOUT)) < 0) {
+			osprd_lockstat_result(locks[i].d, r);
+			while (i-- > 0)
+				osprd_release(locks[i].d, locks[i].filp);
+			break;
+		}
+
+ out:
+	while (n-- > 0)
+		fput(locks[n].filp);
+	return r;
+}
+
+/*
+ * osprd_upgrade(d, filp)
+ *   Turn the read lock held through 'filp' into a write lock.  The request
+ *   goes to the front of the queue, since the lock was granted before
+ *   anyone now waiting asked.  If another upgrade of an overlapping range
+ *   is waiting, each would wait for the other to drop its read lock, so
+ *   this returns -EDEADLK, as it does for a cycle through other devices.
+ *   If interrupted, the read lock is kept.
+ */
+static int osprd_upgrade(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h;
+	osprd_waiter_t w, *other;
+	int r = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	osp_spin_lock(&d->mutex);
+	osprd_unfast(d, filp);
+	if (!(h = osprd_find_file_holder(d, filp)))
+		r = -EINVAL;
+	else if (!h->write)
+		list_for_each_entry(other, &d->waiters, link)
+			if (other->upgrade && other->h->start < h->end
+			    && h->start < other->h->end)
+				r = -EDEADLK;
+	if (r < 0 || h->write) {
+		osp_spin_unlock(&d->mutex);
+		return r;
+	}
+
+	// Give up the read lock while waiting at the front of the queue.
+	// No writer can be granted an overlapping range meanwhile, since
+	// writers never pass a waiting writer.
+	w.filp = filp;
+	w.upgrade = 1;
+	w.queued = 0;
+	spin_lock(&osprd_wfg_lock);
+	osprd_unhold(d, h);
+	h->write = 1;
+	if (osprd_deadlocked(d, h, d->waiters.next)) {
+		h->write = 0;
+		osprd_hold(d, h);
+		r = -EDEADLK;
+	} else
+		osprd_enqueue(d, &w, h, 1);
+	spin_unlock(&osprd_wfg_lock);
+	if (r < 0) {
+		osp_spin_unlock(&d->mutex);
+		return r;
+	}
+	w.ticket = d->ticket_tail;
+	if ((r = osprd_wait(d, &w, h, MAX_SCHEDULE_TIMEOUT)) < 0) {
+		h->write = 0;
+		spin_lock(&osprd_wfg_lock);
+		osprd_hold(d, h);
+		spin_unlock(&osprd_wfg_lock);
+		osprd_grant(d);
+	}
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
+
 /*
- * osprd_lock
+ * osprd_queue_lock(d, filp, start, end)
+ *   Queue a request to lock bytes [start, end) of 'd' through 'filp', as
+ *   osprd_acquire would, but return at once.  The file polls readable once
+ *   the lock is granted; until then OSPRDIOCCANCEL withdraws the request.
+ *   Since the task doesn't block, it may queue requests on any number of
+ *   devices, or for several ranges of one device through different files.
  */
+static int osprd_queue_lock(osprd_info_t *d, struct file *filp,
+			    unsigned long long start, unsigned long long end)
+{
+	osprd_holder_t *h = kmalloc(sizeof(*h), GFP_KERNEL);
+	osprd_waiter_t *w = kmalloc(sizeof(*w), GFP_KERNEL);
+	int r = 0;
+
+	if (!h || !w) {
+		kfree(h);
+		kfree(w);
+		return -ENOMEM;
+	}
+	h->pid = current->pid;
+	h->write = (filp->f_mode & FMODE_WRITE) != 0;
+	h->start = start;
+	h->end = end;
+	w->filp = filp;
+	w->upgrade = 0;
+	w->queued = 1;
+
+	osp_spin_lock(&d->mutex);
+	if (filp->f_flags & (F_OSPRD_LOCKED | F_OSPRD_QUEUED))
+		r = -EBUSY;
+	else {
+		spin_lock(&osprd_wfg_lock);
+		osprd_enqueue(d, w, h, 0);
+		spin_unlock(&osprd_wfg_lock);
+		w->ticket = d->ticket_head++;
+		hlist_add_head(&w->filp_link,
+			       &d->queued_files[hash_ptr(filp, OSPRD_HOLDER_BITS)]);
+		filp->f_flags |= F_OSPRD_QUEUED;
+		// This may grant the lock, and free 'w', at once.
+		osprd_start_wait(d, w);
+	}
+	osp_spin_unlock(&d->mutex);
+	if (r < 0) {
+		kfree(h);
+		kfree(w);
+	}
+	return r;
+}
+
+// Turn the write lock held through 'filp' into a read lock.  Never blocks.
+
+static int osprd_downgrade(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h;
+	int r = 0;
+
+	osp_spin_lock(&d->mutex);
+	if (filp->private_data)
+		/* a fast-path read lock already */;
+	else if (!(h = osprd_find_file_holder(d, filp)))
+		r = -EINVAL;
+	else if (h->write) {
+		spin_lock(&osprd_wfg_lock);
+		osprd_unhold(d, h);
+		h->write = 0;
+		osprd_hold(d, h);
+		spin_unlock(&osprd_wfg_lock);
+		// Readers waiting for this range can go now.
+		osprd_grant(d);
+	}
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
 
 /*
  * osprd_ioctl(inode, filp, cmd, arg)
@@ -373,87 +3780,7 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// (Some of these operations are in a critical section and must
 		// be protected by a spinlock; which ones?)
 
-		// Your code here (instead of the next two lines).
-		unsigned my_ticket;
-		node_t *itr;
-		itr = d->read_locking_pids;
-		//TODO DEADLOCK DETECTION
-		//you just need to check the list in some way
-		osp_spin_lock(&(d->mutex));
-		//I think we check for deadlock here:
-		if(current->pid == d->write_locking_pids->val) {
-			osp_spin_unlock(&(d->mutex));
-			return -EDEADLK;
-		}
-		while (itr != NULL) {
-			if(current->pid == itr->val) {
-				osp_spin_unlock(&(d->mutex));
-				return -EDEADLK;
-			}
-			itr=itr->next;
-		}
-		my_ticket = d->ticket_head;
-		d->ticket_head++;
-		osp_spin_unlock(&(d->mutex));
-
-
-
-		if(filp_writable) {	//write lock 	
-			//returns 0 if condition is true
-			//else, block with no value returned.
-			//if it receives a signal wait_event_interruptible returns a non-zero value (if statement true)	                
-			if(wait_event_interruptible(d->blockq, d->ticket_tail == my_ticket 		//check if it's ticket tail so we can grant a lock   
-				&& d->nwrite == 0  								//write lock size must be 0
-				&& d->nread == 0)) {							//read lock size must be 0
-				//we need to decide where to use spinlocks now.
-				//you also only enter here because of a signal
-
-				osp_spin_lock(&(d->mutex));
-				if(d->ticket_tail==my_ticket) {
-					d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);	//helper function we write by ourselves. ticket tail is invalid. ticket tail +1 may not be.
-					wake_up_all(&(d->blockq));
-				}
-				else {	//d->ticket_tail != my_ticket
-					add_to_ticket_list(d->invalid_tickets, my_ticket);
-				}
-				//TODO: do we need to wakeupall if d->ticket_tail != my_ticket?
-				osp_spin_unlock(&(d->mutex));
-				return -ERESTARTSYS;
-			}
-			//valid ticket, acquire writelock
-			osp_spin_lock(&(d->mutex));
-			//wait_event_interruptible returns 0 here
-			filp->f_flags |= F_OSPRD_LOCKED;
-			add_to_pid_list(d->write_locking_pids, current->pid); //helper function
-			d->nwrite++;	//technically we can just use 0 or 1, and dont need a list.
-			d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-			osp_spin_unlock(&(d->mutex));
-			return 0;
-		}
-		else {	//read lock
-			if(wait_event_interruptible(d->blockq, d->ticket_tail == my_ticket 		//check if it's ticket tail so we can grant a lock   
-				&& d->nwrite == 0 )) {							//read lock size must be 0
-				osp_spin_lock(&(d->mutex));
-				if(d->ticket_tail==my_ticket) {
-					d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);	//helper function we write by ourselves. ticket tail is invalid. ticket tail +1 may not be.
-					wake_up_all(&(d->blockq));
-				}
-				else {	//d->ticket_tail != my_ticket
-					add_to_ticket_list(d->invalid_tickets, my_ticket);
-				}
-				osp_spin_unlock(&(d->mutex));
-				return -ERESTARTSYS;
-			}
-			//wait_event_interruptible returns 0 here
-			osp_spin_lock(&(d->mutex));
-			filp->f_flags |= F_OSPRD_LOCKED;
-			add_to_pid_list(d->read_locking_pids, current->pid); //helper function
-			d->nread++;
-			d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-			osp_spin_unlock(&(d->mutex));
-			return 0;
-		}
-
+		r = osprd_acquire(d, filp, 0, ~0ULL, 0, MAX_SCHEDULE_TIMEOUT);
 
 	} else if (cmd == OSPRDIOCTRYACQUIRE) {
 
@@ -464,91 +3791,296 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// OSPRDIOCTRYACQUIRE should return -EBUSY.
 		// Otherwise, if we can grant the lock request, return 0.
 
-		// Your code here (instead of the next two lines).
-		unsigned my_ticket;
-
-		osp_spin_lock(&(d->mutex));
-		my_ticket = d->ticket_head;		
-		d->ticket_head++;
-		osp_spin_unlock(&(d->mutex));
-
-		//write lock
-		if(filp_writable) {
-			if(d->ticket_tail != my_ticket 		//check if it's ticket tail so we can grant a lock   
-				|| d->nwrite != 0  								//write lock size must be 0
-				|| d->nread != 0) {
-				//in this case, instead of blocking and getting here for a signal, we just return ebusy
-				osp_spin_lock(&(d->mutex));
-				d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-				osp_spin_unlock(&(d->mutex));
-				return -EBUSY;
-			}
-			//in this case, the conditions are valid so we can proceed as regular acquire.
-			osp_spin_lock(&(d->mutex));
-			filp->f_flags |= F_OSPRD_LOCKED;
-			add_to_pid_list(d->write_locking_pids, current->pid); //helper function
-			d->nwrite++;	//technically we can just use 0 or 1, and dont need a list.
-			d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-			osp_spin_unlock(&(d->mutex));
-			return 0;
-		}
+		r = osprd_acquire(d, filp, 0, ~0ULL, 1, 0);
+
+	} else if (cmd == OSPRDIOCACQUIRETIMEOUT) {
+
+		// Like OSPRDIOCACQUIRE, but give up after 'arg' milliseconds.
+		r = osprd_acquire(d, filp, 0, ~0ULL, 0, msecs_to_jiffies(arg));
+
+	} else if (cmd == OSPRDIOCACQUIRERANGE
+		   || cmd == OSPRDIOCTRYACQUIRERANGE) {
+
+		// Lock just a byte range.  Locks of ranges that don't
+		// overlap, or that are both read locks, don't conflict.
+		struct osprd_range range;
+
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if (range.length == 0
+		    || range.offset + range.length < range.offset)
+			return -EINVAL;
+		r = osprd_acquire(d, filp, range.offset,
+				  range.offset + range.length,
+				  cmd == OSPRDIOCTRYACQUIRERANGE,
+				  MAX_SCHEDULE_TIMEOUT);
+
+	} else if (cmd == OSPRDIOCACQUIREMULTI
+		   || cmd == OSPRDIOCTRYACQUIREMULTI) {
+
+		// Lock several devices at once, in a fixed order.  The set
+		// may or may not include this file, so the outcome is
+		// counted on the device it happened on, not on 'd'.
+		struct osprd_fdset set;
+
+		if (copy_from_user(&set, (void __user *) arg, sizeof(set)))
+			return -EFAULT;
+		return osprd_acquire_multi(&set, cmd == OSPRDIOCTRYACQUIREMULTI);
+
+	} else if (cmd == OSPRDIOCENQUEUE) {
+
+		// Queue a lock request without waiting for it.  A null
+		// argument means the whole device.  The request is counted
+		// in the statistics when it is granted, not here.
+		struct osprd_range range;
+
+		if (!arg)
+			return osprd_queue_lock(d, filp, 0, ~0ULL);
+		else if (copy_from_user(&range, (void __user *) arg,
+					sizeof(range)))
+			return -EFAULT;
+		else if (range.length == 0
+			 || range.offset + range.length < range.offset)
+			return -EINVAL;
+		else
+			return osprd_queue_lock(d, filp, range.offset,
+						range.offset + range.length);
+
+	} else if (cmd == OSPRDIOCCANCEL) {
+
+		return osprd_cancel(d, filp);
+
+	} else if (cmd == OSPRDIOCRELEASE) {
+
+		// EXERCISE: Unlock the ramdisk.
+		//
+		// If the file hasn't locked the ramdisk, return -EINVAL.
+		// Otherwise, clear the lock from filp->f_flags, wake up
+		// the wait queue, perform any additional accounting steps
+		// you need, and return 0.
+
+		return osprd_release(d, filp);
+
+	} else if (cmd == OSPRDIOCDISCARD || cmd == OSPRDIOCZERORANGE) {
+
+		// Make a byte range read as zeros and give its memory back.
+		struct osprd_range range;
+
+		if (!filp_writable)
+			return -EBADF;
+		if (d->flags & OSPRD_DEV_READONLY)
+			return -EROFS;
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if ((range.offset | range.length) % d->block_size
+		    || range.offset + range.length < range.offset
+		    || range.offset + range.length > (loff_t) d->nsectors * SECTOR_SIZE)
+			return -EINVAL;
+		if (range.length == 0)
+			return 0;
+
+		r = osprd_zero_range(d, range.offset / SECTOR_SIZE,
+				     range.length / SECTOR_SIZE);
+		// Throw away stale copies in the block device's page cache.
+		truncate_inode_pages_range(filp->f_mapping, range.offset,
+					   range.offset + range.length - 1);
+		return r;
+
+	} else if (cmd == OSPRDIOCFLUSH) {
+
+		// Write the dirty pages back and wait for them to reach the
+		// disk.  Does nothing if the device has no backing file.
+		return osprd_flush_device(d, 1);
+
+	} else if (cmd == OSPRDIOCUPGRADE) {
+
+		// Turn a read lock into a write lock without losing our
+		// place in line.
+		r = osprd_upgrade(d, filp);
+
+	} else if (cmd == OSPRDIOCDOWNGRADE) {
+
+		return osprd_downgrade(d, filp);
+
+	} else if (cmd == OSPRDIOCSETPOLICY) {
+
+		// Change the lock fairness policy.  Waiters the new policy
+		// lets through go at once.
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (arg > OSPRD_MAX_POLICY)
+			return -EINVAL;
+		osp_spin_lock(&d->mutex);
+		d->lock_policy = arg;
+		osprd_grant(d);
+		osp_spin_unlock(&d->mutex);
+		return 0;
+
+	} else if (cmd == OSPRDIOCSTATS) {
+
+		struct osprd_stats stats;
+		osprd_get_stats(d, &stats);
+		if (copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+
+	} else
+		r = -ENOTTY; /* unknown command */
+
+	// Lock requests end up here, to count how they turned out.
+	osprd_lockstat_result(d, r);
+	return r;
+}
+
+
+// Stores through a writable shared mapping bypass osprd_cow, so they are
+// counted in 'nwmaps' and a device that has any cannot be snapshotted.
+
+static inline int osprd_vma_writable(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & (VM_SHARED | VM_MAYWRITE))
+		== (VM_SHARED | VM_MAYWRITE);
+}
+
+/*
+ * osprd_vma_nopage(vma, address, type)
+ *   Called on a page fault in an mmapped ramdisk.  Returns the store's own
+ *   page for that offset, so the mapping sees exactly what the block device
+ *   reads and writes, with no copies.  The page is marked OSPRD_PG_MAPPED:
+ *   from then on it is never compressed, shared, or dropped when zeroed.
+ *   Only OSPRDIOCDISCARD, OSPRDIOCZERORANGE, or shrinking the device
+ *   removes it from the store, after which the mapping keeps the old data.
+ *   A page mapped where it may be written is marked dirty, and stays dirty
+ *   (see osprd_flush_copy), so stores through the mapping reach the
+ *   backing file.
+ */
+static struct page *osprd_vma_nopage(struct vm_area_struct *vma,
+				     unsigned long address, int *type)
+{
+	osprd_info_t *d = (osprd_info_t *) vma->vm_private_data;
+	pgoff_t idx = vma->vm_pgoff + ((address - vma->vm_start) >> PAGE_SHIFT);
+	osprd_shard_t *shard = osprd_shard(d, idx);
+	struct page *page;
+	osprd_page_t *pd;
+	unsigned long flags;
+	int retry;
+
+	if (((loff_t) idx << PAGE_SHIFT) >= (loff_t) d->nsectors * SECTOR_SIZE)
+		return NOPAGE_SIGBUS;
+
+	do {
+		if (osprd_insert_page(d, idx, GFP_KERNEL) < 0
+		    || osprd_page_in(d, idx, GFP_KERNEL) < 0)
+			return NOPAGE_OOM;
+
+		page = NOPAGE_OOM;
+		spin_lock_irqsave(&shard->lock, flags);
+		pd = radix_tree_lookup(&shard->pages, idx);
+		if (pd && osprd_resident_page(shard, pd)
+		    && (!pd->shared || osprd_unshare(shard, pd) == 0)) {
+			pd->flags |= OSPRD_PG_MAPPED;
+			if (osprd_vma_writable(vma))
+				osprd_mark_dirty(shard, pd);
+			page = pd->page;
+			get_page(page);
+		}
+		// if the page was freed or evicted again before we could
+		// look it up, try again
+		retry = !pd || (pd->flags & OSPRD_PG_SPILLED);
+		spin_unlock_irqrestore(&shard->lock, flags);
+	} while (retry);
+
+	if (type)
+		*type = VM_FAULT_MINOR;
+	return page;
+}
+
+static void osprd_vma_open(struct vm_area_struct *vma)
+{
+	osprd_info_t *d = (osprd_info_t *) vma->vm_private_data;
+
+	if (osprd_vma_writable(vma)) {
+		mutex_lock(&osprd_devices_lock);
+		d->nwmaps++;
+		mutex_unlock(&osprd_devices_lock);
+	}
+}
+
+static void osprd_vma_close(struct vm_area_struct *vma)
+{
+	osprd_info_t *d = (osprd_info_t *) vma->vm_private_data;
+
+	if (osprd_vma_writable(vma)) {
+		mutex_lock(&osprd_devices_lock);
+		d->nwmaps--;
+		mutex_unlock(&osprd_devices_lock);
+	}
+}
+
+static struct vm_operations_struct osprd_vm_ops = {
+	.open = osprd_vma_open,
+	.close = osprd_vma_close,
+	.nopage = osprd_vma_nopage
+};
 
-		//read lock
-		else {
-			if(d->ticket_tail != my_ticket 		//check if it's ticket tail so we can grant a lock   
-				|| d->nwrite != 0) {
-				//in this case, instead of blocking and getting here for a signal, we just return ebusy
-				osp_spin_lock(&(d->mutex));
-				d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-				osp_spin_unlock(&(d->mutex));
-				return -EBUSY;
-			}
-			//in this case, the conditions are valid so we can proceed as regular acquire.
-			osp_spin_lock(&(d->mutex));
-			filp->f_flags |= F_OSPRD_LOCKED;
-			add_to_pid_list(d->read_locking_pids, current->pid); //helper function
-			d->nread++;	//technically we can just use 0 or 1, and dont need a list.
-			d->ticket_tail = return_valid_ticket(d->invalid_tickets, d->ticket_tail+1);
-			osp_spin_unlock(&(d->mutex));
-			return 0;
-		}
-		
-	} else if (cmd == OSPRDIOCRELEASE) {
+// Return true if 'filp' holds a read lock on 'd'.  A file open for writing
+// can, after OSPRDIOCDOWNGRADE.
 
-		// EXERCISE: Unlock the ramdisk.
-		//
-		// If the file hasn't locked the ramdisk, return -EINVAL.
-		// Otherwise, clear the lock from filp->f_flags, wake up
-		// the wait queue, perform any additional accounting steps
-		// you need, and return 0.
+static int osprd_file_read_locked(osprd_info_t *d, struct file *filp)
+{
+	osprd_holder_t *h;
+	int r;
 
-		// Your code here (instead of the next line).
+	if (filp->private_data)
+		return 1;
+	osp_spin_lock(&d->mutex);
+	r = ((h = osprd_find_file_holder(d, filp)) && !h->write);
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
 
-		//hasn't locked the ramdisk
-		int lock_check;
-		osp_spin_lock(&(d->mutex));
-		lock_check = filp->f_flags | F_OSPRD_LOCKED;
-		if(filp->f_flags != lock_check) {
-			osp_spin_unlock(&(d->mutex));
-			return -EINVAL;
-		}
-		else {
-			filp->f_flags = (filp->f_flags & (~F_OSPRD_LOCKED));	//clear lock
-			if(filp_writable) {
-				remove_from_list(d->write_locking_pids, current->pid);
-				d->nwrite--;
-			}
-			else {
-				remove_from_list(d->read_locking_pids, current->pid);
-				d->nread--;
-			}
-			wake_up_all(&(d->blockq));
-		}
-		osp_spin_unlock(&(d->mutex));
-		return 0;
+/*
+ * osprd_mmap(filp, vma)
+ *   Map the ramdisk's storage pages directly into user space.  Once made,
+ *   a mapping is not checked against the ramdisk's locks, just as read()
+ *   and write() aren't; processes that share a ramdisk take locks around
+ *   their accesses either way.  A file that holds a read lock only gets a
+ *   read-only mapping, though.  Snapshots, and origins that have one, only
+ *   get read-only shared mappings.
+ */
+static int osprd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	osprd_info_t *d = file2osprd(filp);
+	loff_t end = ((loff_t) vma->vm_pgoff << PAGE_SHIFT)
+		+ (vma->vm_end - vma->vm_start);
+	int r = 0;
 
-	} else
-		r = -ENOTTY; /* unknown command */
+	if (!d)
+		return -ENODEV;
+	if (end > (loff_t) d->nsectors * SECTOR_SIZE)
+		return -EINVAL;
+
+	if ((d->flags & OSPRD_DEV_READONLY)
+	    || ((filp->f_mode & FMODE_WRITE) && osprd_file_read_locked(d, filp))) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_ops = &osprd_vm_ops;
+	vma->vm_flags |= VM_RESERVED;
+	vma->vm_private_data = d;
+
+	mutex_lock(&osprd_devices_lock);
+	if (osprd_vma_writable(vma)) {
+		if (d->dep && (vma->vm_flags & VM_WRITE))
+			r = -EBUSY;
+		else if (d->dep)
+			vma->vm_flags &= ~VM_MAYWRITE;
+		else
+			d->nwmaps++;
+	}
+	mutex_unlock(&osprd_devices_lock);
 	return r;
 }
 
@@ -557,6 +4089,8 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 static void osprd_setup(osprd_info_t *d)
 {
+	unsigned i;
+
 	/* Initialize the wait queue. */
 	init_waitqueue_head(&(d->blockq));
 	osp_spin_lock_init(&(d->mutex));
@@ -564,18 +4098,19 @@ static void osprd_setup(osprd_info_t *d)
 	/* Add code here if you add fields to osprd_info_t. */
 	d->nread = 0;
 	d->nwrite = 0;
-
-	d->invalid_tickets = (node_t *) kmalloc(sizeof (node_t*), GFP_ATOMIC);
-	d->invalid_tickets->next = NULL;	//next is already null
-	d->invalid_tickets->val = -1;	//TODO: initialize this properly.
-
-	d->write_locking_pids = (node_t*) kmalloc(sizeof(node_t*), GFP_ATOMIC);
-	d->write_locking_pids->next = NULL;//	d->write_locking_pids->val = -1;    //TODO: initialize this properly.
-	d->write_locking_pids->val = -1;
-
-	d->read_locking_pids = (node_t*) kmalloc(sizeof(node_t*), GFP_ATOMIC);
-	d->read_locking_pids->next = NULL;
-	d->read_locking_pids->val = -1;    //TODO: initialize this properly.
+	INIT_LIST_HEAD(&d->waiters);
+	for (i = 0; i < OSPRD_HOLDER_HASH; i++) {
+		INIT_HLIST_HEAD(&d->holders[i]);
+		INIT_HLIST_HEAD(&d->holder_files[i]);
+		INIT_HLIST_HEAD(&d->queued_files[i]);
+	}
+	for (i = 0; i < OSPRD_TASK_HASH; i++)
+		atomic_set(&d->task_locks[i], 0);
+	d->read_ranges = d->write_ranges = RB_ROOT;
+	d->nwwait = 0;
+	d->lock_policy = lock_policy;
+	d->read_phase = 1;
+	osprd_fast_update(d);
 }
 
 
@@ -597,6 +4132,21 @@ static void osprd_process_request_queue(request_queue_t *q)
 }
 
 
+// Poll an OSP ramdisk file.  Like any block device it is always ready,
+// except that it isn't readable while a lock request queued through it
+// with OSPRDIOCENQUEUE waits.  osprd_grant wakes d->blockq.
+
+static unsigned int osprd_poll(struct file *filp, poll_table *wait)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	poll_wait(filp, &d->blockq, wait);
+	if (filp->f_flags & F_OSPRD_QUEUED)
+		return POLLOUT | POLLWRNORM;
+	return DEFAULT_POLLMASK;
+}
+
+
 // Some particularly horrible stuff to get around some Linux issues:
 // the Linux block device interface doesn't let a block device find out
 // which file has been closed.  We need this information.
@@ -613,22 +4163,56 @@ static int _osprd_release(struct inode *inode, struct file *filp)
 
 static int _osprd_open(struct inode *inode, struct file *filp)
 {
+	struct gendisk *gd = inode->i_bdev->bd_disk;
+	int which = gd->first_minor;
+
+	// Refuse opens that race with the device being destroyed.
+	mutex_lock(&osprd_devices_lock);
+	if (which >= OSPRD_MAX_DEVICES || !osprds[which]
+	    || osprds[which] != gd->private_data) {
+		mutex_unlock(&osprd_devices_lock);
+		return -ENXIO;
+	} else if (osprds[which]->restoring) {
+		mutex_unlock(&osprd_devices_lock);
+		return -EBUSY;
+	}
+	osprds[which]->users++;
+	mutex_unlock(&osprd_devices_lock);
+
 	if (!osprd_blk_fops.open) {
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		osprd_blk_fops.mmap = osprd_mmap;
+		osprd_blk_fops.poll = osprd_poll;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
 }
 
+// The block layer calls this once per successful _osprd_open, including
+// for its own opens (mounts, blkdev_get), which never go through a file's
+// release.  So this is where the 'users' count drops.
+
+static int osprd_bdev_release(struct inode *inode, struct file *filp)
+{
+	osprd_info_t *d = inode->i_bdev->bd_disk->private_data;
+
+	mutex_lock(&osprd_devices_lock);
+	d->users--;
+	mutex_unlock(&osprd_devices_lock);
+	return 0;
+}
+
 
 // The device operations structure.
 
 static struct block_device_operations osprd_ops = {
 	.owner = THIS_MODULE,
 	.open = _osprd_open,
-	// .release = osprd_release, // we must call our own release
+	// Lock cleanup is done by _osprd_release, which sees the file;
+	// this one only balances the 'users' count.
+	.release = osprd_bdev_release,
 	.ioctl = osprd_ioctl
 };
 
@@ -676,38 +4260,213 @@ static void for_each_open_file(struct task_struct *task,
 }
 
 
+// Free every page of the backing store.
+
+static void osprd_free_pages(osprd_info_t *d)
+{
+	struct page *page, *next;
+	unsigned i;
+
+	for (i = 0; i < d->nshards; i++) {
+		osprd_shard_drop(&d->shards[i], 0, ~0UL);
+		kfree(d->shards[i].dedup_hash);
+		list_for_each_entry_safe(page, next, &d->shards[i].pool, lru)
+			__free_page(page);
+	}
+}
+
+
+// The lock instrumentation files in debugfs: osprd/lock_stats, the on/off
+// switch, and for each device osprd/osprdX/lock_stats and reset.
+
+static struct dentry *osprd_debugfs;
+static struct dentry *osprd_debugfs_switch;
+
+static void osprd_show_hist(struct seq_file *m, const char *name,
+			    const char *kind, unsigned long *hist)
+{
+	int b;
+
+	seq_printf(m, "%s_ns_%s:\n", name, kind);
+	for (b = 0; b < OSPRD_HIST_BUCKETS; b++)
+		if (hist[b])
+			seq_printf(m, "  %llu %lu\n",
+				   b ? 1ULL << (b - 1) : 0ULL, hist[b]);
+}
+
+static int osprd_lockstat_show(struct seq_file *m, void *v)
+{
+	static const char *kinds[2] = { "read", "write" };
+	osprd_info_t *d = (osprd_info_t *) m->private;
+	osprd_lockstat_t *sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	unsigned long *to = (unsigned long *) sum;
+	unsigned i;
+	int cpu, w;
+
+	if (!sum)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		unsigned long *from = (unsigned long *) per_cpu_ptr(d->lockstat, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(unsigned long); i++)
+			to[i] += from[i];
+	}
+
+	for (w = 0; w < 2; w++)
+		seq_printf(m, "acquires_%s %lu\nreleases_%s %lu\n",
+			   kinds[w], sum->acquires[w], kinds[w], sum->releases[w]);
+	seq_printf(m, "try_fails %lu\ndeadlocks %lu\ninterrupts %lu\n"
+		   "timeouts %lu\n", sum->try_fails, sum->deadlocks,
+		   sum->interrupts, sum->timeouts);
+	for (w = 0; w < 2; w++) {
+		osprd_show_hist(m, "wait", kinds[w], sum->wait_hist[w]);
+		osprd_show_hist(m, "hold", kinds[w], sum->hold_hist[w]);
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int osprd_lockstat_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, osprd_lockstat_show, inode->u.generic_ip);
+}
+
+static struct file_operations osprd_lockstat_fops = {
+	.owner = THIS_MODULE,
+	.open = osprd_lockstat_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+// Zero the counters on any write.  Counts made on other CPUs meanwhile
+// may survive.
+
+static int osprd_reset_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = inode->u.generic_ip;
+	return 0;
+}
+
+static ssize_t osprd_reset_write(struct file *filp, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	osprd_info_t *d = (osprd_info_t *) filp->private_data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(d->lockstat, cpu), 0, sizeof(osprd_lockstat_t));
+	return count;
+}
+
+static struct file_operations osprd_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = osprd_reset_open,
+	.write = osprd_reset_write
+};
+
+
 // Destroy a osprd_info_t.
 
 static void cleanup_device(osprd_info_t *d)
 {
-	wake_up_all(&d->blockq);
+	// debugfs can't remove a directory with files in it.
+	if (d->debugfs_dir) {
+		debugfs_remove(d->debugfs_stats);
+		debugfs_remove(d->debugfs_reset);
+		debugfs_remove(d->debugfs_dir);
+	}
 	if (d->gd) {
+		wake_up_all(&d->blockq);
 		del_gendisk(d->gd);
 		put_disk(d->gd);
 	}
 	if (d->queue)
 		blk_cleanup_queue(d->queue);
-	if (d->data)
-		vfree(d->data);
+	osprd_backing_close(d);
+	if (d->shards)
+		osprd_free_pages(d);
+	kfree(d->shards);
+	if (d->spill)
+		filp_close(d->spill, NULL);
+	if (d->iostat)
+		free_percpu(d->iostat);
+	if (d->readers)
+		free_percpu(d->readers);
+	if (d->lockstat)
+		free_percpu(d->lockstat);
 }
 
 
-// Initialize a osprd_info_t.
+// Initialize a osprd_info_t.  'origin' is the device it is a snapshot or
+// clone of, or NULL.
 
-static int setup_device(osprd_info_t *d, int which)
+static int setup_device(osprd_info_t *d, int which,
+			const struct osprd_device *spec, osprd_info_t *origin)
 {
+	unsigned i;
+
 	memset(d, 0, sizeof(osprd_info_t));
+	d->nsectors = spec->size / SECTOR_SIZE;
+	d->block_size = spec->block_size;
+	d->numa_node = spec->numa_node;
+	d->flags = spec->flags;
+	d->origin = origin;
+	d->ram_limit = spec->ram_limit;
 
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* The block data is allocated a page at a time, on first write.
+	 * In queue_mode 2 it is split into a power-of-2 number of shards,
+	 * at least one per CPU. */
+	d->nshards = 1;
+	if (queue_mode == OSPRD_QUEUE_MQ)
+		while (d->nshards < num_possible_cpus())
+			d->nshards <<= 1;
+	if (!(d->shards = kcalloc(d->nshards, sizeof(osprd_shard_t), GFP_KERNEL)))
+		return -1;
+	for (i = 0; i < d->nshards; i++) {
+		osprd_shard_t *shard = &d->shards[i];
+		INIT_RADIX_TREE(&shard->pages, GFP_ATOMIC);
+		spin_lock_init(&shard->lock);
+		shard->dev = d;
+		spin_lock_init(&shard->pool_lock);
+		INIT_LIST_HEAD(&shard->pool);
+		if (dedup && !(shard->dedup_hash = kcalloc(OSPRD_DEDUP_BUCKETS,
+							   sizeof(struct hlist_head),
+							   GFP_KERNEL)))
+			return -1;
+	}
+	if (!(d->iostat = alloc_percpu(osprd_iostat_t)))
+		return -1;
+	if (!(d->readers = alloc_percpu(osprd_readers_t)))
+		return -1;
+	if (!(d->lockstat = alloc_percpu(osprd_lockstat_t)))
+		return -1;
+	for_each_possible_cpu(i) {
+		spin_lock_init(&per_cpu_ptr(d->readers, i)->lock);
+		INIT_HLIST_HEAD(&per_cpu_ptr(d->readers, i)->holders);
+	}
+	if (d->ram_limit && osprd_spill_open(d, which) < 0) {
+		printk(KERN_WARNING "osprd: can't create spill file for osprd%c\n",
+		       'a' + which);
 		return -1;
-	memset(d->data, 0, nsectors * SECTOR_SIZE);
+	}
+	if (backing_dir && !origin && osprd_backing_open(d, which) < 0) {
+		printk(KERN_WARNING "osprd: can't open backing file for osprd%c\n",
+		       'a' + which);
+		return -1;
+	}
 
 	/* Set up the I/O queue. */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+	if (queue_mode == OSPRD_QUEUE_BIO || queue_mode == OSPRD_QUEUE_MQ) {
+		if (!(d->queue = blk_alloc_queue(GFP_KERNEL)))
+			return -1;
+		blk_queue_make_request(d->queue, osprd_make_request);
+	} else if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
 		return -1;
-	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
+	else
+		// osprd_process_request maps highmem pages itself
+		blk_queue_bounce_limit(d->queue, BLK_BOUNCE_ANY);
+	blk_queue_hardsect_size(d->queue, d->block_size);
 	d->queue->queuedata = d;
 
 	/* The gendisk structure. */
@@ -719,23 +4478,453 @@ static int setup_device(osprd_info_t *d, int which)
 	d->gd->queue = d->queue;
 	d->gd->private_data = d;
 	snprintf(d->gd->disk_name, 32, "osprd%c", which + 'a');
-	set_capacity(d->gd, nsectors);
+	set_capacity(d->gd, d->nsectors);
+	if (d->flags & OSPRD_DEV_READONLY)
+		set_disk_ro(d->gd, 1);
 	add_disk(d->gd);
 
+	/* Instrumentation files; the device works without them. */
+	if (osprd_debugfs
+	    && (d->debugfs_dir = debugfs_create_dir(d->gd->disk_name,
+						     osprd_debugfs))) {
+		d->debugfs_stats = debugfs_create_file("lock_stats", 0444,
+						       d->debugfs_dir, d,
+						       &osprd_lockstat_fops);
+		d->debugfs_reset = debugfs_create_file("reset", 0200,
+						       d->debugfs_dir, d,
+						       &osprd_reset_fops);
+	}
+
 	/* Call the setup function. */
 	osprd_setup(d);
 
 	return 0;
 }
 
+
+// Create a device as osprd_create_device does, as a snapshot or clone of
+// 'origin' if that is non-NULL.  Called with osprd_devices_lock held.
+
+static int __osprd_create_device(const struct osprd_device *spec,
+				 osprd_info_t *origin)
+{
+	int which = spec->index;
+	osprd_info_t *d;
+
+	if (which == -1)
+		for (which = 0; which < OSPRD_MAX_DEVICES && osprds[which]; which++)
+			/* do nothing */;
+	if (which == OSPRD_MAX_DEVICES || osprds[which])
+		return which == OSPRD_MAX_DEVICES ? -ENOSPC : -EEXIST;
+
+	if (!(d = kmalloc(sizeof(osprd_info_t), GFP_KERNEL)))
+		return -ENOMEM;
+	if (setup_device(d, which, spec, origin) < 0) {
+		cleanup_device(d);
+		kfree(d);
+		return -ENOMEM;
+	}
+	osprds[which] = d;
+	return which;
+}
+
+/*
+ * osprd_create_device(spec)
+ *   Create the ramdisk described by 'spec': its index (or -1 for the first
+ *   free one), size, block size, and placement.  Returns the device's index
+ *   or a negative error code.
+ */
+static int osprd_create_device(const struct osprd_device *spec)
+{
+	int which = spec->index;
+	int r;
+
+	if (which < -1 || which >= OSPRD_MAX_DEVICES || spec->size == 0
+	    || (spec->block_size != SECTOR_SIZE && spec->block_size != PAGE_SIZE)
+	    || spec->size % spec->block_size
+	    || (spec->flags & ~(OSPRD_DEV_INTERLEAVE | OSPRD_DEV_HUGEPAGES))
+	    || spec->numa_node < -1 || spec->numa_node >= MAX_NUMNODES
+	    || (spec->numa_node >= 0 && !node_online(spec->numa_node))
+	    || (spec->ram_limit && (!spill_dir || backing_dir
+				    || queue_mode == OSPRD_QUEUE_RQ)))
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	r = __osprd_create_device(spec, NULL);
+	mutex_unlock(&osprd_devices_lock);
+	return r;
+}
+
+// Lock or unlock every shard of 'd', as when setting or clearing 'd->dep'.
+// Called with interrupts off.
+
+static void osprd_lock_shards(osprd_info_t *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->nshards; i++)
+		spin_lock(&d->shards[i].lock);
+}
+
+static void osprd_unlock_shards(osprd_info_t *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->nshards; i++)
+		spin_unlock(&d->shards[i].lock);
+}
+
+// Unlink device 'd' from its origin, so the origin stops copying pages to
+// it.  Called with osprd_devices_lock held.
+
+static void osprd_unlink_origin(osprd_info_t *d)
+{
+	unsigned long flags;
+
+	if (!d->origin)
+		return;
+	local_irq_save(flags);
+	osprd_lock_shards(d->origin);
+	d->origin->dep = NULL;
+	osprd_unlock_shards(d->origin);
+	local_irq_restore(flags);
+}
+
+/*
+ * osprd_snapshot(snap)
+ *   Create a snapshot or clone of each device listed in 'snap', and set
+ *   each entry's 'index' to the new device's.  The new devices start out
+ *   sharing every page with their origins; the origins are frozen together,
+ *   with all of their shard locks held at once, so that the snapshots are
+ *   consistent across devices.  Takes time independent of the devices'
+ *   sizes.  Returns 0 or a negative error code, in which case no devices
+ *   were created.
+ */
+static int osprd_snapshot(struct osprd_snapshot *snap)
+{
+	osprd_info_t *origins[OSPRD_MAX_SNAPSHOT];
+	struct osprd_device spec;
+	unsigned long flags;
+	unsigned i, j, ncreated = 0;
+	int r = 0;
+
+	if (snap->count == 0 || snap->count > OSPRD_MAX_SNAPSHOT)
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	for (i = 0; i < snap->count && r == 0; i++) {
+		int which = snap->devs[i].origin;
+		if (which < 0 || which >= OSPRD_MAX_DEVICES
+		    || snap->devs[i].index < -1
+		    || snap->devs[i].index >= OSPRD_MAX_DEVICES
+		    || (snap->devs[i].flags & ~OSPRD_SNAP_CLONE))
+			r = -EINVAL;
+		else if (!(origins[i] = osprds[which]))
+			r = -ENXIO;
+		else if (origins[i]->origin || origins[i]->ram_limit)
+			r = -EINVAL;
+		else if (origins[i]->dep || origins[i]->nwmaps
+			 || origins[i]->restoring)
+			r = -EBUSY;
+		for (j = 0; j < i && r == 0; j++)
+			if (origins[j] == origins[i])
+				r = -EINVAL;
+	}
+
+	for (i = 0; i < snap->count && r == 0; i++) {
+		spec.index = snap->devs[i].index;
+		spec.size = (unsigned long long) origins[i]->nsectors * SECTOR_SIZE;
+		spec.block_size = origins[i]->block_size;
+		spec.numa_node = origins[i]->numa_node;
+		spec.ram_limit = 0;
+		spec.flags = (origins[i]->flags & ~OSPRD_DEV_READONLY)
+			| (snap->devs[i].flags & OSPRD_SNAP_CLONE ? 0 : OSPRD_DEV_READONLY);
+		if ((r = __osprd_create_device(&spec, origins[i])) >= 0) {
+			snap->devs[i].index = r;
+			ncreated++;
+			r = 0;
+		}
+	}
+
+	if (r < 0) {
+		// Undo the devices created so far; nothing links to them yet.
+		for (i = 0; i < ncreated; i++) {
+			cleanup_device(osprds[snap->devs[i].index]);
+			kfree(osprds[snap->devs[i].index]);
+			osprds[snap->devs[i].index] = NULL;
+		}
+		mutex_unlock(&osprd_devices_lock);
+		return r;
+	}
+
+	// Freeze.  From here on, every origin page that changes is first
+	// copied to the dependent; see osprd_cow.
+	local_irq_save(flags);
+	for (i = 0; i < snap->count; i++)
+		osprd_lock_shards(origins[i]);
+	for (i = 0; i < snap->count; i++) {
+		origins[i]->epoch++;
+		origins[i]->dep = osprds[snap->devs[i].index];
+	}
+	for (i = snap->count; i-- > 0; )
+		osprd_unlock_shards(origins[i]);
+	local_irq_restore(flags);
+
+	mutex_unlock(&osprd_devices_lock);
+	return 0;
+}
+
+/*
+ * osprd_destroy_device(which)
+ *   Destroy ramdisk 'which' and free its memory.  Fails with -EBUSY if the
+ *   device is open or has a snapshot or clone.
+ */
+static int osprd_destroy_device(int which)
+{
+	osprd_info_t *d;
+
+	if (which < 0 || which >= OSPRD_MAX_DEVICES)
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	if (!(d = osprds[which])) {
+		mutex_unlock(&osprd_devices_lock);
+		return -ENXIO;
+	} else if (d->users || d->dep) {
+		mutex_unlock(&osprd_devices_lock);
+		return -EBUSY;
+	}
+	osprd_unlink_origin(d);
+	osprds[which] = NULL;
+	mutex_unlock(&osprd_devices_lock);
+
+	cleanup_device(d);
+	kfree(d);
+	return 0;
+}
+
+/*
+ * osprd_resize_device(which, nsect)
+ *   Change ramdisk 'which' to 'nsect' sectors.  Growing works while the
+ *   device is in use and copies nothing: the new sectors are holes.
+ *   Shrinking frees the data past the new end, so it is only allowed while
+ *   the device is closed, and never for a device with a backing file.
+ *   Snapshots, clones, and their origins keep their size.
+ */
+static int osprd_resize_device(int which, sector_t nsect)
+{
+	struct block_device *bdev;
+	osprd_info_t *d;
+	int r = 0;
+
+	if (which < 0 || which >= OSPRD_MAX_DEVICES || nsect == 0)
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	if (!(d = osprds[which]))
+		r = -ENXIO;
+	else if (d->origin || d->dep || d->restoring)
+		r = -EBUSY;
+	else if (nsect % (d->block_size / SECTOR_SIZE)
+		 || (nsect < d->nsectors && d->backing))
+		r = -EINVAL;
+	else if (nsect < d->nsectors && d->users)
+		r = -EBUSY;
+	else if (nsect < d->nsectors
+		 && (r = osprd_zero_range(d, nsect, d->nsectors - nsect)) < 0)
+		/* keep the old size */;
+	else if (nsect < d->nsectors) {
+		d->nsectors = nsect;
+		set_capacity(d->gd, nsect);
+	} else {
+		d->nsectors = nsect;
+		set_capacity(d->gd, nsect);
+		// Let files that already have the device open see the new size.
+		if ((bdev = bdget_disk(d->gd, 0))) {
+			mutex_lock(&bdev->bd_inode->i_mutex);
+			i_size_write(bdev->bd_inode, (loff_t) nsect * SECTOR_SIZE);
+			mutex_unlock(&bdev->bd_inode->i_mutex);
+			bdput(bdev);
+		}
+	}
+	mutex_unlock(&osprd_devices_lock);
+	return r;
+}
+
+/*
+ * osprd_save_device(which, path)
+ *   Save ramdisk 'which' to image file 'path'.  The device stays usable
+ *   meanwhile, but cannot be destroyed.
+ */
+static int osprd_save_device(int which, const char *path)
+{
+	osprd_info_t *d;
+	int r;
+
+	if (which < 0 || which >= OSPRD_MAX_DEVICES)
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	if (!(d = osprds[which]))
+		r = -ENXIO;
+	else if (d->restoring)
+		r = -EBUSY;
+	else {
+		d->users++;
+		r = 0;
+	}
+	mutex_unlock(&osprd_devices_lock);
+	if (r < 0)
+		return r;
+
+	r = osprd_save_image(d, path);
+
+	mutex_lock(&osprd_devices_lock);
+	d->users--;
+	mutex_unlock(&osprd_devices_lock);
+	return r;
+}
+
+/*
+ * osprd_restore_device(which, path)
+ *   Replace the contents of ramdisk 'which' with image file 'path'.  The
+ *   device must be closed and have no snapshot or origin.  Until the
+ *   restore is done it cannot be opened, resized, snapshotted, saved or
+ *   destroyed, but the other devices are not held up.
+ */
+static int osprd_restore_device(int which, const char *path)
+{
+	osprd_info_t *d;
+	int r;
+
+	if (which < 0 || which >= OSPRD_MAX_DEVICES)
+		return -EINVAL;
+
+	mutex_lock(&osprd_devices_lock);
+	if (!(d = osprds[which]))
+		r = -ENXIO;
+	else if (d->users || d->origin || d->dep)
+		r = -EBUSY;
+	else {
+		// The reference keeps the device from being destroyed, and
+		// 'restoring' from being opened, while the image is read
+		// without the lock.
+		d->users++;
+		d->restoring = 1;
+		r = 0;
+	}
+	mutex_unlock(&osprd_devices_lock);
+	if (r < 0)
+		return r;
+
+	r = osprd_restore_image(d, path);
+
+	mutex_lock(&osprd_devices_lock);
+	d->restoring = 0;
+	d->users--;
+	mutex_unlock(&osprd_devices_lock);
+	return r;
+}
+
+// Return the name of device 'which's image file in 'image_dir', in a
+// kmalloc'd buffer, or NULL if out of memory.
+
+static char *osprd_image_path(int which)
+{
+	char *path = kmalloc(OSPRD_PATH_MAX, GFP_KERNEL);
+
+	if (path)
+		snprintf(path, OSPRD_PATH_MAX, "%s/osprd%c.img", image_dir,
+			 'a' + which);
+	return path;
+}
+
+
+// ioctls on the control device, /dev/osprdctl.
+
+static int osprd_ctl_ioctl(struct inode *inode, struct file *filp,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct osprd_device dev;
+	struct osprd_snapshot snap;
+	struct osprd_image img;
+	unsigned i;
+	int r;
+
+	if (cmd != OSPRDIOCCREATE && cmd != OSPRDIOCDESTROY
+	    && cmd != OSPRDIOCRESIZE && cmd != OSPRDIOCSNAPSHOT
+	    && cmd != OSPRDIOCSAVE && cmd != OSPRDIOCRESTORE)
+		return -ENOTTY;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (cmd == OSPRDIOCSAVE || cmd == OSPRDIOCRESTORE) {
+		if (copy_from_user(&img, (void __user *) arg, sizeof(img)))
+			return -EFAULT;
+		img.path[OSPRD_PATH_MAX - 1] = '\0';
+		if (cmd == OSPRDIOCSAVE)
+			return osprd_save_device(img.index, img.path);
+		else
+			return osprd_restore_device(img.index, img.path);
+	}
+
+	if (cmd == OSPRDIOCSNAPSHOT) {
+		if (copy_from_user(&snap, (void __user *) arg, sizeof(snap)))
+			return -EFAULT;
+		if ((r = osprd_snapshot(&snap)) < 0)
+			return r;
+		if (copy_to_user((void __user *) arg, &snap, sizeof(snap))) {
+			for (i = 0; i < snap.count; i++)
+				osprd_destroy_device(snap.devs[i].index);
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	if (copy_from_user(&dev, (void __user *) arg, sizeof(dev)))
+		return -EFAULT;
+	if (cmd != OSPRDIOCDESTROY && dev.size % SECTOR_SIZE)
+		return -EINVAL;
+
+	if (cmd == OSPRDIOCCREATE) {
+		if (!dev.block_size)
+			dev.block_size = block_size;
+		if ((r = osprd_create_device(&dev)) < 0)
+			return r;
+		dev.index = r;
+		if (copy_to_user((void __user *) arg, &dev, sizeof(dev))) {
+			osprd_destroy_device(r);
+			return -EFAULT;
+		}
+		return 0;
+	} else if (cmd == OSPRDIOCDESTROY)
+		return osprd_destroy_device(dev.index);
+	else
+		return osprd_resize_device(dev.index, dev.size / SECTOR_SIZE);
+}
+
+static struct file_operations osprd_ctl_fops = {
+	.owner = THIS_MODULE,
+	.ioctl = osprd_ctl_ioctl
+};
+
+static struct miscdevice osprd_ctl_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "osprdctl",
+	.fops = &osprd_ctl_fops
+};
+static int osprd_ctl_registered;
+static int osprd_loaded;		// set once osprd_init succeeds
+
 static void osprd_exit(void);
 
 
 // The kernel calls this function when the module is loaded.
-// It initializes the 4 osprd block devices.
+// It initializes the first 'ndevices' osprd block devices.
 
 static int __init osprd_init(void)
 {
+	struct osprd_device spec;
 	int i, r;
 
 	// shut up the compiler
@@ -745,23 +4934,109 @@ static int __init osprd_init(void)
 	(void) osp_spin_unlock;
 #endif
 
+	osprd_page_cachep = kmem_cache_create("osprd_page", sizeof(osprd_page_t),
+					      0, 0, NULL, NULL);
+	if (!osprd_page_cachep)
+		return -ENOMEM;
+
 	/* Register the block device name. */
 	if (register_blkdev(OSPRD_MAJOR, "osprd") < 0) {
 		printk(KERN_WARNING "osprd: unable to get major number\n");
+		kmem_cache_destroy(osprd_page_cachep);
 		return -EBUSY;
 	}
 
+	/* Backed disks must be able to sleep while handling a request. */
+	r = 0;
+	if (backing_dir && (queue_mode == OSPRD_QUEUE_RQ || flush_interval <= 0)) {
+		printk(KERN_WARNING "osprd: backing_dir needs queue_mode 1 or 2 "
+		       "and a positive flush_interval\n");
+		r = -EINVAL;
+	}
+	if (compress_interval > 0 && queue_mode == OSPRD_QUEUE_RQ) {
+		printk(KERN_WARNING "osprd: compress_interval needs queue_mode "
+		       "1 or 2\n");
+		r = -EINVAL;
+	}
+	if (lock_policy < 0 || lock_policy > OSPRD_MAX_POLICY) {
+		printk(KERN_WARNING "osprd: bad lock_policy %d\n", lock_policy);
+		r = -EINVAL;
+	}
+
+	/* Start the eviction thread before any disk has a RAM budget. */
+	if (r == 0 && spill_dir) {
+		if (!(osprd_spill_buf = kmalloc(PAGE_SIZE, GFP_KERNEL)))
+			r = -ENOMEM;
+		else if (IS_ERR(osprd_spilld = kthread_run(osprd_spill_thread, NULL,
+							      "osprd_spilld"))) {
+			osprd_spilld = NULL;
+			r = -ENOMEM;
+		}
+	}
+
+	/* The debugfs directory, if debugfs is there. */
+	osprd_debugfs = debugfs_create_dir("osprd", NULL);
+	if (IS_ERR(osprd_debugfs))
+		osprd_debugfs = NULL;
+	else if (osprd_debugfs)
+		osprd_debugfs_switch = debugfs_create_u32("lock_stats", 0644,
+							  osprd_debugfs,
+							  &lock_stats);
+
 	/* Initialize the device structures. */
-	for (i = r = 0; i < NOSPRD; i++)
-		if (setup_device(&osprds[i], i) < 0)
-			r = -EINVAL;
+	spec.size = (unsigned long long) nsectors * SECTOR_SIZE;
+	spec.block_size = block_size;
+	spec.numa_node = numa_node;
+	spec.flags = (interleave ? OSPRD_DEV_INTERLEAVE : 0)
+		| (hugepages ? OSPRD_DEV_HUGEPAGES : 0);
+	spec.ram_limit = (unsigned long long) ram_limit_mb << 20;
+	if (r == 0 && (ndevices < 0 || ndevices > OSPRD_MAX_DEVICES
+		       || nsectors <= 0))
+		r = -EINVAL;
+	else if (r == 0)
+		for (i = 0; i < ndevices; i++) {
+			spec.index = i;
+			if (osprd_create_device(&spec) < 0)
+				r = -EINVAL;
+		}
+
+	/* The control device, for creating and resizing devices later. */
+	if (r == 0 && misc_register(&osprd_ctl_dev) < 0)
+		r = -EINVAL;
+	else if (r == 0)
+		osprd_ctl_registered = 1;
+
+	/* Restore the disks from their images, if asked to. */
+	if (r == 0 && image_dir)
+		for (i = 0; i < ndevices; i++) {
+			char *path = osprd_image_path(i);
+			int rr = (path ? osprd_restore_device(i, path) : -ENOMEM);
+			if (rr < 0 && rr != -ENOENT)
+				printk(KERN_WARNING "osprd: can't restore %s: error %d\n",
+				       path ? path : "image", rr);
+			kfree(path);
+		}
+
+	/* Start writing dirty pages back, if the disks are backed. */
+	if (r == 0 && backing_dir) {
+		osprd_flushd = kthread_run(osprd_flush_thread, NULL, "osprd_flushd");
+		if (IS_ERR(osprd_flushd)) {
+			osprd_flushd = NULL;
+			r = -ENOMEM;
+		}
+	}
+
+	/* Start compressing cold pages, if asked to. */
+	if (r == 0 && compress_interval > 0 && osprd_compress_init() < 0)
+		r = -EINVAL;
 
 	if (r < 0) {
 		printk(KERN_EMERG "osprd: can't set up device structures\n");
 		osprd_exit();
 		return -EBUSY;
-	} else
-		return 0;
+	}
+	osprd_loaded = 1;
+	return 0;
 }
 
 
@@ -771,9 +5046,58 @@ static int __init osprd_init(void)
 static void osprd_exit(void)
 {
 	int i;
-	for (i = 0; i < NOSPRD; i++)
-		cleanup_device(&osprds[i]);
+	if (compress_interval > 0)
+		osprd_compress_stop();
+	if (osprd_flushd)
+		kthread_stop(osprd_flushd);
+	osprd_flushd = NULL;
+	if (osprd_spilld)
+		kthread_stop(osprd_spilld);
+	osprd_spilld = NULL;
+	kfree(osprd_spill_buf);
+	osprd_spill_buf = NULL;
+	if (osprd_ctl_registered)
+		misc_deregister(&osprd_ctl_dev);
+	osprd_ctl_registered = 0;
+	// Save the disks for the next load -- but not after a failed load,
+	// which would overwrite good images.
+	if (osprd_loaded && image_dir)
+		for (i = 0; i < OSPRD_MAX_DEVICES; i++) {
+			char *path;
+			int rr;
+			if (!osprds[i])
+				continue;
+			path = osprd_image_path(i);
+			rr = (path ? osprd_save_image(osprds[i], path) : -ENOMEM);
+			if (rr < 0)
+				printk(KERN_WARNING "osprd: can't save %s: error %d\n",
+				       path ? path : "image", rr);
+			kfree(path);
+		}
+	osprd_loaded = 0;
+	// Snapshots and clones go first: their origins copy pages into them.
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++)
+		if (osprds[i] && osprds[i]->origin) {
+			osprd_unlink_origin(osprds[i]);
+			cleanup_device(osprds[i]);
+			kfree(osprds[i]);
+			osprds[i] = NULL;
+		}
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++)
+		if (osprds[i]) {
+			cleanup_device(osprds[i]);
+			kfree(osprds[i]);
+			osprds[i] = NULL;
+		}
+	if (compress_interval > 0)
+		osprd_compress_exit();
+	if (osprd_debugfs) {
+		debugfs_remove(osprd_debugfs_switch);
+		debugfs_remove(osprd_debugfs);
+	}
+	osprd_debugfs = NULL;
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
+	kmem_cache_destroy(osprd_page_cachep);
 }
 
 
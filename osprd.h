@@ -5,5 +5,164 @@
 #define OSPRDIOCACQUIRE		42
 #define OSPRDIOCTRYACQUIRE	43
 #define OSPRDIOCRELEASE		44
+#define OSPRDIOCDISCARD		45	// arg: struct osprd_range *
+#define OSPRDIOCZERORANGE	46	// arg: struct osprd_range *
+#define OSPRDIOCSTATS		47	// arg: struct osprd_stats *
+#define OSPRDIOCFLUSH		54	// write back dirty data; no arg
+#define OSPRDIOCACQUIRERANGE	55	// arg: struct osprd_range *
+#define OSPRDIOCTRYACQUIRERANGE	56	// arg: struct osprd_range *
+#define OSPRDIOCSETPOLICY	57	// arg: OSPRD_POLICY_* (a value)
+#define OSPRDIOCACQUIRETIMEOUT	58	// arg: timeout in ms (a value)
+#define OSPRDIOCUPGRADE		59	// read lock to write lock; no arg.
+					//   -EBADF if the file isn't open
+					//   for writing
+#define OSPRDIOCDOWNGRADE	60	// write lock to read lock; no arg
+#define OSPRDIOCACQUIREMULTI	61	// arg: struct osprd_fdset *
+#define OSPRDIOCTRYACQUIREMULTI	62	// arg: struct osprd_fdset *
+#define OSPRDIOCENQUEUE		63	// arg: struct osprd_range *, or 0
+					//   for the whole device
+#define OSPRDIOCCANCEL		64	// withdraw an OSPRDIOCENQUEUE; no arg
+
+// ioctl constants for the control device, /dev/osprdctl
+#define OSPRDIOCCREATE		48	// arg: struct osprd_device *
+#define OSPRDIOCDESTROY		49	// arg: struct osprd_device *
+#define OSPRDIOCRESIZE		50	// arg: struct osprd_device *
+#define OSPRDIOCSNAPSHOT	51	// arg: struct osprd_snapshot *
+#define OSPRDIOCSAVE		52	// arg: struct osprd_image *
+#define OSPRDIOCRESTORE		53	// arg: struct osprd_image *
+
+// A byte range of a ramdisk.  For OSPRDIOCDISCARD and OSPRDIOCZERORANGE,
+// both fields must be multiples of the device's block size; a range lock
+// can cover any nonempty range.
+struct osprd_range {
+	unsigned long long offset;
+	unsigned long long length;
+};
+
+// Argument to OSPRDIOCACQUIREMULTI: lock each device open as one of 'fds'
+// through that file, as OSPRDIOCACQUIRE would.  Either every lock is
+// taken or none is.
+#define OSPRD_MAX_FDSET		16
+struct osprd_fdset {
+	unsigned count;
+	int fds[OSPRD_MAX_FDSET];
+};
+
+// Lock fairness policies, for OSPRDIOCSETPOLICY.
+#define OSPRD_POLICY_FIFO	0	// strict ticket order
+#define OSPRD_POLICY_BATCH	1	// queued readers pass a blocked writer,
+					//   a bounded number of times
+#define OSPRD_POLICY_PHASE	2	// phase-fair: readers wait for at most
+					//   one write phase, and writers for
+					//   at most one read phase
+#define OSPRD_MAX_POLICY	2
+
+// A ramdisk, as named to the control device's ioctls.
+struct osprd_device {
+	int index;			// 0 for /dev/osprda, 1 for /dev/osprdb,
+					//   ...; -1 asks OSPRDIOCCREATE to pick
+	unsigned long long size;	// capacity in bytes; a multiple of the
+					//   block size
+	unsigned block_size;		// OSPRDIOCCREATE: logical block size,
+					//   512 or 4096; 0 for the default
+	int numa_node;			// OSPRDIOCCREATE: NUMA node for the
+					//   data, or -1 for any
+	unsigned flags;			// OSPRDIOCCREATE: OSPRD_DEV_* below
+	unsigned long long ram_limit;	// OSPRDIOCCREATE: bytes of RAM the
+					//   data may use before cold pages
+					//   spill to a file; 0 for no limit
+};
+
+#define OSPRD_DEV_INTERLEAVE	0x1	// spread the data across NUMA nodes
+#define OSPRD_DEV_HUGEPAGES	0x2	// allocate the data in 2MB extents
+#define OSPRD_DEV_READONLY	0x4	// a snapshot; set by OSPRDIOCSNAPSHOT
+
+// Devices to snapshot with OSPRDIOCSNAPSHOT.  All of them are frozen at the
+// same instant, so the snapshots are consistent with each other.  Each new
+// device shares its origin's pages until one side writes them (copy-on-write
+// a page at a time).  An origin can have one snapshot or clone at a time,
+// and a snapshot or clone cannot itself be snapshotted.
+#define OSPRD_MAX_SNAPSHOT	8
+
+struct osprd_snapshot {
+	unsigned count;			// number of entries used in 'devs'
+	struct {
+		int origin;		// device to snapshot: 0 for /dev/osprda
+		int index;		// device to create, or -1 for the first
+					//   free one; set on return
+		unsigned flags;		// OSPRD_SNAP_CLONE below
+	} devs[OSPRD_MAX_SNAPSHOT];
+};
+
+#define OSPRD_SNAP_CLONE	0x1	// make a writable clone instead of a
+					//   read-only snapshot
+
+// A ramdisk and an image file, for OSPRDIOCSAVE and OSPRDIOCRESTORE.
+// A relative 'path' is relative to the caller's working directory.
+// OSPRDIOCRESTORE replaces the device's contents; the device must be
+// closed, at least as large as the image, and have no snapshot.
+#define OSPRD_PATH_MAX		256
+
+struct osprd_image {
+	int index;			// 0 for /dev/osprda, ...
+	char path[OSPRD_PATH_MAX];	// image file, null-terminated
+};
+
+// Ramdisk image files start with this header, followed by 'npages'
+// records.  Each record is a page index (unsigned long long) followed by
+// 'page_size' bytes of data.  Holes and all-zero pages have no record, so
+// an image is only as large as the data it holds.
+#define OSPRD_IMAGE_MAGIC	"OSPRDIMG"
+#define OSPRD_IMAGE_VERSION	1
+
+struct osprd_image_header {
+	char magic[8];			// OSPRD_IMAGE_MAGIC, unterminated
+	unsigned version;		// OSPRD_IMAGE_VERSION
+	unsigned page_size;		// bytes of data per record
+	unsigned long long size;	// capacity of the saved device
+	unsigned long long npages;	// number of records
+};
+
+// Number of NUMA nodes whose usage OSPRDIOCSTATS reports.
+#define OSPRD_MAX_NODES		8
+
+// Per-device statistics returned by OSPRDIOCSTATS.
+struct osprd_stats {
+	unsigned long long capacity;	// device size in bytes
+	unsigned long long used_bytes;	// bytes of memory holding data
+	unsigned long long compressed_pages;	// pages held compressed
+	unsigned long long compressed_bytes;	// memory those pages use
+	unsigned long long decompressions;	// number of decompressions
+	unsigned long long decompress_ns;	// total time spent decompressing
+	unsigned long long dedup_saved_bytes;	// memory saved by sharing pages
+	unsigned long long zero_writes;	// page writes of zeros not stored
+	unsigned long long reads;	// completed read requests
+	unsigned long long writes;	// completed write requests
+	unsigned long long read_bytes;	// bytes read
+	unsigned long long write_bytes;	// bytes written
+	long long numa_node;		// NUMA node asked for, or -1
+	unsigned long long flags;	// OSPRD_DEV_* flags
+	unsigned long long huge_extents;	// 2MB extents allocated
+	unsigned long long node_pages[OSPRD_MAX_NODES];
+					// resident pages on each node
+	long long origin;		// device this is a snapshot or clone
+					//   of, or -1
+	unsigned long long cow_copies;	// pages copied to keep it unchanged
+	unsigned long long dirty_pages;	// pages not yet in the backing file
+	unsigned long long flush_runs;	// writes to the backing file
+	unsigned long long flush_bytes;	// bytes written to it
+	unsigned long long ram_limit;	// RAM budget in bytes, or 0
+	unsigned long long spilled_pages;	// pages now in the spill file
+	unsigned long long spill_hits;	// accesses to pages in RAM
+	unsigned long long spill_misses;	// pages read back from the file
+	unsigned long long evictions;	// pages written out to the file
+	unsigned long long lock_policy;	// OSPRD_POLICY_*
+	unsigned long long read_waits;	// read locks granted after queueing
+	unsigned long long read_wait_ns;	//   and their total wait
+	unsigned long long write_waits;	// the same for write locks
+	unsigned long long write_wait_ns;
+	unsigned long long max_wait_ns;	// longest wait for a lock
+	unsigned long long block_size;	// logical block size in bytes
+};
 
 #endif
@@ -3,7 +3,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -27,8 +29,32 @@ Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    -L [DELAY]\n\
        Attempt to lock the ramdisk without blocking.  This is like -l, but if\n\
        -l would block, -L will return a \"resource busy\" error instead.\n\
+   -P\n\
+       With -l, queue the lock request with OSPRDIOCENQUEUE and wait for it\n\
+       with poll(), instead of blocking in the ioctl.\n\
+   -T TIMEOUT\n\
+       With -l, give up with a \"timed out\" error if the lock isn't\n\
+       granted within TIMEOUT seconds.  The request keeps its place in\n\
+       line until then.  With -R, -T needs -P as well.\n\
+   -R\n\
+       With -l or -L, lock only the bytes to be read or written (from OFF\n\
+       to the end of the device if no SIZE is given).  Locks of bytes that\n\
+       don't overlap don't wait for each other.\n\
+   -M\n\
+       With -l or -L, lock all the devices given at once, after opening the\n\
+       last one, instead of each one as it is opened.  The lock DELAY, -D,\n\
+       -d, and -U then all apply to that lock, for every device.\n\
+   -D\n\
+       Right after locking, turn a write lock into a read lock.\n\
    -d DELAY\n\
        Wait DELAY seconds before reading/writing (but after locking).\n\
+   -U\n\
+       After the -d delay, turn the read lock into a write lock.  This\n\
+       comes before anyone who started waiting for the lock meanwhile.\n\
+       Only works with -w: a device opened read-only can't be written,\n\
+       so the upgrade fails with a \"bad file descriptor\" error.\n\
+   -m\n\
+       Read by mmapping the device instead of with read().\n\
    DEVICE is the device to read/write.  The default is /dev/osprda.\n\
    You can also give more than one device name.  All devices are opened, but\n\
    only the last device is read or written.\n");
@@ -125,18 +151,81 @@ void transfer_zero(int fd2, ssize_t size)
 	}
 }
 
+void transfer_mmap(int fd1, int fd2, ssize_t offset, ssize_t size)
+{
+	off_t start = offset & ~((off_t) getpagesize() - 1);
+	off_t end = lseek(fd1, 0, SEEK_END);
+	char *map;
+
+	if (end == (off_t) -1) {
+		perror("lseek");
+		exit(1);
+	}
+	if (size < 0 || offset + size > end)
+		size = (offset < end ? end - offset : 0);
+	if (size == 0)
+		return;
+
+	map = mmap(NULL, offset - start + size, PROT_READ, MAP_SHARED, fd1, start);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	if (write(fd2, map + (offset - start), size) != size) {
+		perror("write");
+		exit(1);
+	}
+	munmap(map, offset - start + size);
+}
+
+// Queue a lock request on 'devfd' (for 'range', or for the whole device
+// if it is NULL), and poll until it is granted.  Withdraw it if that
+// takes more than 'timeout' seconds, unless 'timeout' is negative.
+
+void queue_lock(int devfd, struct osprd_range *range, double timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	if (ioctl(devfd, OSPRDIOCENQUEUE, range) == -1) {
+		perror("ioctl OSPRDIOCENQUEUE");
+		exit(1);
+	}
+	pfd.fd = devfd;
+	pfd.events = POLLIN;
+	do {
+		r = poll(&pfd, 1, timeout < 0 ? -1 : (int) (timeout * 1000));
+	} while (r == -1 && errno == EINTR);
+	if (r == -1) {
+		perror("poll");
+		exit(1);
+	} else if (r == 0) {
+		// The cancel fails if the lock was granted just now.
+		if (ioctl(devfd, OSPRDIOCCANCEL, NULL) == 0) {
+			fprintf(stderr, "osprdaccess: lock request timed out\n");
+			exit(1);
+		} else if (errno != EINVAL) {
+			perror("ioctl OSPRDIOCCANCEL");
+			exit(1);
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	char *newarg;
-	int devfd, ofd;
-	int i, r, timeout = 0, zero = 0;
-	int mode = O_RDONLY, dolock = 0, dotrylock = 0;
+	int devfd, i, zero = 0, usemmap = 0;
+	int mode = O_RDONLY, dolock = 0, dotrylock = 0, dorange = 0;
+	int dodowngrade = 0, doupgrade = 0, domulti = 0, dopoll = 0;
+	struct osprd_fdset fdset;
 	ssize_t size = -1;
 	ssize_t offset = 0;
 	double delay = 0;
 	double lock_delay = 0;
+	double lock_timeout = -1;
 	const char *devname = "/dev/osprda";
 
+	fdset.count = 0;
+
  flag:
 	// Detect a read/write option
 	if (argc >= 2 && strcmp(argv[1], "-r") == 0) {
@@ -181,6 +270,48 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a lock timeout option
+	if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		if (argc < 3 || !parse_double(argv[2], &lock_timeout)
+		    || lock_timeout < 0)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a poll option
+	if (argc >= 2 && strcmp(argv[1], "-P") == 0) {
+		dopoll = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a range-lock option
+	if (argc >= 2 && strcmp(argv[1], "-R") == 0) {
+		dorange = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a multi-device lock option
+	if (argc >= 2 && strcmp(argv[1], "-M") == 0) {
+		domulti = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect downgrade and upgrade options
+	if (argc >= 2 && strcmp(argv[1], "-D") == 0) {
+		dodowngrade = 1;
+		argv++, argc--;
+		goto flag;
+	}
+	if (argc >= 2 && strcmp(argv[1], "-U") == 0) {
+		doupgrade = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
 	// Detect a delay option
 	if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
 		argv++, argc--;
@@ -196,6 +327,13 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect an mmap option
+	if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
+		usemmap = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
 	// Detect a help option
 	if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
 		usage(0);
@@ -206,6 +344,10 @@ int main(int argc, char *argv[])
 		argv++, argc--;
 	}
 
+	// There is no timed range lock ioctl; only -P can time one out
+	if (dolock && dorange && lock_timeout >= 0 && !dopoll)
+		usage(1);
+
 	// Open ramdisk file
 	devfd = open(devname, mode);
 	if (devfd == -1) {
@@ -214,10 +356,38 @@ int main(int argc, char *argv[])
 	}
 
 	// Lock, possibly after delay
-	if (dolock || dotrylock) {
+	if ((dolock || dotrylock) && domulti) {
+		if (fdset.count == OSPRD_MAX_FDSET) {
+			fprintf(stderr, "osprdaccess: too many devices for -M\n");
+			exit(1);
+		}
+		fdset.fds[fdset.count++] = devfd;
+	} else if (dolock || dotrylock) {
 		if (lock_delay >= 0)
 			sleep_for(lock_delay);
-		if (dolock
+		if (dolock && dopoll) {
+			struct osprd_range range;
+			range.offset = offset;
+			range.length = (size >= 0 ? (unsigned long long) size
+					: ~0ULL - offset);
+			queue_lock(devfd, dorange ? &range : NULL, lock_timeout);
+		} else if (dorange) {
+			struct osprd_range range;
+			range.offset = offset;
+			range.length = (size >= 0 ? (unsigned long long) size
+					: ~0ULL - offset);
+			if (ioctl(devfd, dolock ? OSPRDIOCACQUIRERANGE
+				  : OSPRDIOCTRYACQUIRERANGE, &range) == -1) {
+				perror(dolock ? "ioctl OSPRDIOCACQUIRERANGE"
+				       : "ioctl OSPRDIOCTRYACQUIRERANGE");
+				exit(1);
+			}
+		} else if (dolock && lock_timeout >= 0
+			   && ioctl(devfd, OSPRDIOCACQUIRETIMEOUT,
+				    (unsigned long) (lock_timeout * 1000)) == -1) {
+			perror("ioctl OSPRDIOCACQUIRETIMEOUT");
+			exit(1);
+		} else if (dolock && lock_timeout < 0
 		    && ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCACQUIRE");
 			exit(1);
@@ -226,16 +396,52 @@ int main(int argc, char *argv[])
 			perror("ioctl OSPRDIOCTRYACQUIRE");
 			exit(1);
 		}
+		if (dodowngrade && ioctl(devfd, OSPRDIOCDOWNGRADE, NULL) == -1) {
+			perror("ioctl OSPRDIOCDOWNGRADE");
+			exit(1);
+		}
 	}
 
 	// Delay
-	if (delay >= 0)
+	if (delay >= 0 && !domulti)
 		sleep_for(delay);
 
+	// Upgrade
+	if ((dolock || dotrylock) && doupgrade && !domulti
+	    && ioctl(devfd, OSPRDIOCUPGRADE, NULL) == -1) {
+		perror("ioctl OSPRDIOCUPGRADE");
+		exit(1);
+	}
+
 	// If more arguments, go around for the next ramdisk
 	if (argc > 1)
 		goto flag;
 
+	// Lock all the ramdisks at once, then downgrade, delay, and upgrade
+	// each lock as for a single ramdisk
+	if (domulti && fdset.count) {
+		if (lock_delay >= 0)
+			sleep_for(lock_delay);
+		if (ioctl(devfd, dolock ? OSPRDIOCACQUIREMULTI
+			  : OSPRDIOCTRYACQUIREMULTI, &fdset) == -1) {
+			perror(dolock ? "ioctl OSPRDIOCACQUIREMULTI"
+			       : "ioctl OSPRDIOCTRYACQUIREMULTI");
+			exit(1);
+		}
+		for (i = 0; dodowngrade && i < fdset.count; i++)
+			if (ioctl(fdset.fds[i], OSPRDIOCDOWNGRADE, NULL) == -1) {
+				perror("ioctl OSPRDIOCDOWNGRADE");
+				exit(1);
+			}
+		if (delay >= 0)
+			sleep_for(delay);
+		for (i = 0; doupgrade && i < fdset.count; i++)
+			if (ioctl(fdset.fds[i], OSPRDIOCUPGRADE, NULL) == -1) {
+				perror("ioctl OSPRDIOCUPGRADE");
+				exit(1);
+			}
+	}
+
 	// Seek to offset
 	if (lseek(devfd, offset, SEEK_SET) == (off_t) -1) {
 		perror("lseek");
@@ -247,6 +453,8 @@ int main(int argc, char *argv[])
 		transfer_zero(devfd, size);
 	else if (mode & O_WRONLY)
 		transfer(STDIN_FILENO, devfd, size);
+	else if (usemmap)
+		transfer_mmap(devfd, STDOUT_FILENO, offset, size);
 	else
 		transfer(devfd, STDOUT_FILENO, size);
 
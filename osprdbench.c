@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Measures random-access throughput of an OSP ramdisk device.\n\
+Usage: ./osprdbench [OPTIONS] [DEVICE]\n\
+   or: ./osprdbench -l [-n ABANDONED] [DEVICE]\n\
+   or: ./osprdbench -c WAITERS [-s SECONDS] [DEVICE]\n\
+   or: ./osprdbench -x PROCS [-s SECONDS]\n\
+   Options are:\n\
+   -t THREADS\n\
+       Run with THREADS threads.  Default is to run 1, 2, 4, and 8 threads\n\
+       in turn.\n\
+   -s SECONDS\n\
+       Run each test for SECONDS seconds.  Default is 2.\n\
+   -w PERCENT\n\
+       Make PERCENT percent of the accesses writes.  Default is 0.\n\
+   -b SIZE\n\
+       Make each access SIZE bytes.  Default is 4096.\n\
+   Every access is an O_DIRECT read or write at a random aligned offset.\n\
+   Load the module with queue_mode=2 to compare the sharded store, or with\n\
+   block_size=4096 to compare the block sizes.  The number of requests the\n\
+   driver saw per access is printed too.\n\
+   -l measures the latency of an uncontended lock acquire and release\n\
+   instead, as more and more waiters give up their tickets (by taking a\n\
+   signal while blocked); the latency should not grow with them.  The\n\
+   first ABANDONED tickets are abandoned; the default is 8192.\n\
+   -c runs WAITERS threads that take turns write-locking the device, and\n\
+   prints the context switches per lock hand-off.  If every release woke\n\
+   every waiter, that would grow with WAITERS; it should stay near 1.\n\
+   -x runs PROCS processes that each write-lock several of /dev/osprda\n\
+   through /dev/osprdd, in random order, and release them, over and over.\n\
+   A process whose request is refused as a deadlock releases what it holds\n\
+   and starts again.  Exits with status 1 if the processes get stuck.\n\
+   DEVICE defaults to /dev/osprda.\n");
+	exit(status);
+}
+
+struct bench {
+	const char *devname;
+	off_t nblocks;
+	int block_size;
+	int write_percent;
+	volatile int stop;
+};
+
+struct worker {
+	pthread_t thread;
+	struct bench *bench;
+	unsigned seed;
+	unsigned long long ios;
+};
+
+void *run_worker(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	struct bench *b = w->bench;
+	void *buf;
+	int fd;
+
+	if (posix_memalign(&buf, b->block_size, b->block_size) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 'x', b->block_size);
+	fd = open(b->devname, (b->write_percent ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd == -1) {
+		perror(b->devname);
+		exit(1);
+	}
+
+	while (!b->stop) {
+		off_t off = (off_t) (rand_r(&w->seed) % b->nblocks) * b->block_size;
+		ssize_t r;
+		if ((int) (rand_r(&w->seed) % 100) < b->write_percent)
+			r = pwrite(fd, buf, b->block_size, off);
+		else
+			r = pread(fd, buf, b->block_size, off);
+		if (r != b->block_size) {
+			perror(r < 0 ? "pread/pwrite" : "short transfer");
+			exit(1);
+		}
+		w->ios++;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+void run_bench(struct bench *b, int nthreads, double seconds)
+{
+	struct worker *w = calloc(nthreads, sizeof(struct worker));
+	struct timeval start, end;
+	struct osprd_stats before, after;
+	unsigned long long ios = 0;
+	int fd = open(b->devname, O_RDONLY);
+	double elapsed;
+	int i;
+
+	b->stop = 0;
+	if (ioctl(fd, OSPRDIOCSTATS, &before) == -1) {
+		perror("ioctl OSPRDIOCSTATS");
+		exit(1);
+	}
+	gettimeofday(&start, 0);
+	for (i = 0; i < nthreads; i++) {
+		w[i].bench = b;
+		w[i].seed = start.tv_usec + i;
+		if (pthread_create(&w[i].thread, NULL, run_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	usleep((useconds_t) (seconds * 1000000));
+	b->stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		ios += w[i].ios;
+	}
+	gettimeofday(&end, 0);
+	if (ioctl(fd, OSPRDIOCSTATS, &after) == -1) {
+		perror("ioctl OSPRDIOCSTATS");
+		exit(1);
+	}
+	close(fd);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("threads %d iops %.0f requests_per_io %.2f\n", nthreads,
+	       ios / elapsed, ios ? (double) (after.reads + after.writes
+					     - before.reads - before.writes) / ios : 0);
+	free(w);
+}
+
+
+#define LOCK_BATCH	64		// waiters abandoned at a time
+#define LOCK_ROUNDS	10000		// acquire/release pairs timed
+
+struct waiter {
+	pthread_t thread;
+	const char *devname;
+	volatile int done;
+};
+
+void on_signal(int signo)
+{
+	(void) signo;
+}
+
+void *run_waiter(void *arg)
+{
+	struct waiter *w = (struct waiter *) arg;
+	int fd = open(w->devname, O_RDWR);
+
+	if (fd == -1) {
+		perror(w->devname);
+		exit(1);
+	}
+	if (ioctl(fd, OSPRDIOCACQUIRE, NULL) != -1 || errno != EINTR) {
+		fprintf(stderr, "waiter was not interrupted\n");
+		exit(1);
+	}
+	close(fd);
+	w->done = 1;
+	return NULL;
+}
+
+// Abandon LOCK_BATCH tickets: block that many waiters behind a write lock,
+// then signal them all.
+void abandon_tickets(const char *devname)
+{
+	struct waiter w[LOCK_BATCH];
+	int fd = open(devname, O_RDWR), i;
+
+	if (fd == -1 || ioctl(fd, OSPRDIOCACQUIRE, NULL) == -1) {
+		perror(devname);
+		exit(1);
+	}
+	for (i = 0; i < LOCK_BATCH; i++) {
+		w[i].devname = devname;
+		w[i].done = 0;
+		if (pthread_create(&w[i].thread, NULL, run_waiter, &w[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	// Keep signalling each waiter until it gives up: a signal that
+	// arrives before it blocks is lost.
+	usleep(10000);
+	for (i = 0; i < LOCK_BATCH; i++) {
+		while (!w[i].done) {
+			pthread_kill(w[i].thread, SIGUSR1);
+			usleep(1000);
+		}
+		pthread_join(w[i].thread, NULL);
+	}
+	ioctl(fd, OSPRDIOCRELEASE, NULL);
+	close(fd);
+}
+
+// Return the average nanoseconds of an uncontended acquire and release.
+double time_lock(const char *devname)
+{
+	struct timeval start, end;
+	int fd = open(devname, O_RDWR), i;
+
+	if (fd == -1) {
+		perror(devname);
+		exit(1);
+	}
+	gettimeofday(&start, 0);
+	for (i = 0; i < LOCK_ROUNDS; i++)
+		if (ioctl(fd, OSPRDIOCACQUIRE, NULL) == -1
+		    || ioctl(fd, OSPRDIOCRELEASE, NULL) == -1) {
+			perror("ioctl");
+			exit(1);
+		}
+	gettimeofday(&end, 0);
+	close(fd);
+	return ((end.tv_sec - start.tv_sec) * 1e9
+		+ (end.tv_usec - start.tv_usec) * 1e3) / LOCK_ROUNDS;
+}
+
+void run_lock_bench(const char *devname, int abandoned)
+{
+	struct sigaction sa;
+	int n;
+
+	// No SA_RESTART, so the signal interrupts the blocked ioctl.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	for (n = 0; ; n += LOCK_BATCH) {
+		if ((n & (n - 1)) == 0 || n >= abandoned)
+			printf("abandoned %d lock_ns %.0f\n", n, time_lock(devname));
+		if (n >= abandoned)
+			break;
+		abandon_tickets(devname);
+	}
+}
+
+struct contender {
+	pthread_t thread;
+	const char *devname;
+	volatile int *stop;
+	unsigned long long handoffs;
+};
+
+void *run_contender(void *arg)
+{
+	struct contender *c = (struct contender *) arg;
+	int fd = open(c->devname, O_RDWR);
+
+	if (fd == -1) {
+		perror(c->devname);
+		exit(1);
+	}
+	while (!*c->stop) {
+		if (ioctl(fd, OSPRDIOCACQUIRE, NULL) == -1
+		    || ioctl(fd, OSPRDIOCRELEASE, NULL) == -1) {
+			perror("ioctl");
+			exit(1);
+		}
+		c->handoffs++;
+	}
+	close(fd);
+	return NULL;
+}
+
+void run_contention_bench(const char *devname, int nwaiters, double seconds)
+{
+	struct contender *c = calloc(nwaiters, sizeof(struct contender));
+	struct rusage before, after;
+	unsigned long long handoffs = 0;
+	long csw;
+	volatile int stop = 0;
+	int i;
+
+	getrusage(RUSAGE_SELF, &before);
+	for (i = 0; i < nwaiters; i++) {
+		c[i].devname = devname;
+		c[i].stop = &stop;
+		if (pthread_create(&c[i].thread, NULL, run_contender, &c[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	usleep((useconds_t) (seconds * 1000000));
+	stop = 1;
+	for (i = 0; i < nwaiters; i++) {
+		pthread_join(c[i].thread, NULL);
+		handoffs += c[i].handoffs;
+	}
+	getrusage(RUSAGE_SELF, &after);
+
+	// RUSAGE_SELF counts the switches of every thread in the process.
+	csw = (after.ru_nvcsw - before.ru_nvcsw)
+		+ (after.ru_nivcsw - before.ru_nivcsw);
+	printf("waiters %d handoffs %llu csw_per_handoff %.2f\n", nwaiters,
+	       handoffs, handoffs ? (double) csw / handoffs : 0);
+	free(c);
+}
+
+#define STRESS_DEVICES 4
+
+// Lock random subsets of the devices in random order until 'deadline'.
+// Returns the number of rounds completed and, in '*deadlocks', the number
+// of requests refused with EDEADLK.
+
+unsigned long run_stress_proc(int *fds, unsigned seed, time_t deadline,
+			      unsigned long *deadlocks)
+{
+	unsigned long rounds = 0;
+	int order[STRESS_DEVICES];
+	int i, j, n, t;
+
+	*deadlocks = 0;
+	while (time(NULL) < deadline) {
+		for (i = 0; i < STRESS_DEVICES; i++)
+			order[i] = i;
+		for (i = STRESS_DEVICES - 1; i > 0; i--) {
+			j = rand_r(&seed) % (i + 1);
+			t = order[i], order[i] = order[j], order[j] = t;
+		}
+		n = 2 + rand_r(&seed) % (STRESS_DEVICES - 1);
+		for (i = 0; i < n; i++)
+			if (ioctl(fds[order[i]], OSPRDIOCACQUIRE, NULL) == -1) {
+				if (errno != EDEADLK) {
+					perror("ioctl OSPRDIOCACQUIRE");
+					exit(1);
+				}
+				(*deadlocks)++;
+				break;
+			}
+		for (j = 0; j < i; j++)
+			if (ioctl(fds[order[j]], OSPRDIOCRELEASE, NULL) == -1) {
+				perror("ioctl OSPRDIOCRELEASE");
+				exit(1);
+			}
+		if (i == n)
+			rounds++;
+	}
+	return rounds;
+}
+
+void run_stress(int nprocs, double seconds)
+{
+	time_t deadline = time(NULL) + (time_t) (seconds + 0.999);
+	unsigned long counts[2], rounds = 0, deadlocks = 0;
+	int pfd[2], fds[STRESS_DEVICES];
+	char devname[] = "/dev/osprda";
+	pid_t *pids = calloc(nprocs, sizeof(pid_t));
+	int i, status, stuck = 0;
+
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	for (i = 0; i < nprocs; i++) {
+		if ((pids[i] = fork()) == -1) {
+			perror("fork");
+			exit(1);
+		} else if (pids[i] == 0) {
+			int d;
+			for (d = 0; d < STRESS_DEVICES; d++) {
+				devname[10] = 'a' + d;
+				if ((fds[d] = open(devname, O_RDWR)) == -1) {
+					perror(devname);
+					exit(1);
+				}
+			}
+			counts[0] = run_stress_proc(fds, getpid(), deadline,
+						    &counts[1]);
+			write(pfd[1], counts, sizeof(counts));
+			exit(0);
+		}
+	}
+	close(pfd[1]);
+
+	// A missed deadlock leaves processes blocked forever.  Give them a
+	// generous grace period past the deadline.
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	for (i = 0; i < nprocs && !stuck; ) {
+		ssize_t r = read(pfd[0], counts, sizeof(counts));
+		if (r == sizeof(counts)) {
+			rounds += counts[0];
+			deadlocks += counts[1];
+			i++;
+		} else if (r == 0)
+			// A process failed; its exit status is checked below.
+			break;
+		else if (time(NULL) >= deadline + 5)
+			stuck = 1;
+		else
+			usleep(10000);
+	}
+	for (i = 0; i < nprocs; i++) {
+		if (stuck)
+			kill(pids[i], SIGKILL);
+		waitpid(pids[i], &status, 0);
+		if (!stuck && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			exit(1);
+	}
+	free(pids);
+	if (stuck) {
+		fprintf(stderr, "osprdbench: processes stuck: deadlock not detected\n");
+		exit(1);
+	}
+	printf("procs %d rounds %lu deadlocks %lu\n", nprocs, rounds,
+	       deadlocks);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b;
+	int nthreads = 0, lockbench = 0, abandoned = 8192, nwaiters = 0;
+	int nprocs = 0;
+	double seconds = 2;
+	off_t size;
+	int fd, i;
+
+	memset(&b, 0, sizeof(b));
+	b.devname = "/dev/osprda";
+	b.block_size = 4096;
+
+	for (i = 1; i < argc; i++)
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			nthreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seconds = atof(argv[++i]);
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			b.block_size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			b.write_percent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-l") == 0)
+			lockbench = 1;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			abandoned = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			nwaiters = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+			nprocs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+			usage(0);
+		else if (argv[i][0] != '-')
+			b.devname = argv[i];
+		else
+			usage(1);
+	if (nthreads < 0 || seconds <= 0 || b.block_size < 512
+	    || b.block_size % 512
+	    || b.write_percent < 0 || b.write_percent > 100 || abandoned < 0
+	    || nwaiters < 0 || nprocs < 0)
+		usage(1);
+
+	if (lockbench) {
+		run_lock_bench(b.devname, abandoned);
+		exit(0);
+	} else if (nwaiters) {
+		run_contention_bench(b.devname, nwaiters, seconds);
+		exit(0);
+	} else if (nprocs) {
+		run_stress(nprocs, seconds);
+		exit(0);
+	}
+
+	// Find the device size
+	if ((fd = open(b.devname, O_RDONLY)) == -1) {
+		perror(b.devname);
+		exit(1);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	if ((b.nblocks = size / b.block_size) <= 0) {
+		fprintf(stderr, "%s: device smaller than %d bytes\n",
+			b.devname, b.block_size);
+		exit(1);
+	}
+
+	if (nthreads)
+		run_bench(&b, nthreads, seconds);
+	else
+		for (nthreads = 1; nthreads <= 8; nthreads *= 2)
+			run_bench(&b, nthreads, seconds);
+	exit(0);
+}
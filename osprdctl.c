@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Manages OSP ramdisk devices.\n\
+Usage: ./osprdctl stats [DEVICE]\n\
+   or: ./osprdctl discard DEVICE OFF SIZE\n\
+   or: ./osprdctl zero DEVICE OFF SIZE\n\
+   or: ./osprdctl flush [DEVICE]\n\
+   or: ./osprdctl policy DEVICE fifo|batch|phase\n\
+   or: ./osprdctl create [-b BLOCKSIZE] [-n NODE] [-i] [-H] [-m LIMIT] SIZE [DEVICE]\n\
+   or: ./osprdctl destroy DEVICE\n\
+   or: ./osprdctl resize DEVICE SIZE\n\
+   or: ./osprdctl snapshot [-c] DEVICE[:NEWDEVICE]...\n\
+   or: ./osprdctl save DEVICE FILE\n\
+   or: ./osprdctl restore DEVICE FILE\n\
+   stats prints how much memory DEVICE is using.\n\
+   discard and zero make SIZE bytes at offset OFF read as zeros, and give\n\
+       the memory behind them back.  OFF and SIZE must be multiples of the\n\
+       device's block size.\n\
+   flush writes DEVICE's dirty data back to its backing file (if the module\n\
+       was loaded with backing_dir) and waits for it to reach the disk.\n\
+   policy sets how DEVICE's lock orders readers and writers: fifo serves\n\
+       requests strictly in order; batch lets queued readers pass a\n\
+       waiting writer (a bounded number of times); phase alternates, so\n\
+       readers wait for at most one writer and writers for at most one\n\
+       batch of readers.  stats shows the resulting lock waits.\n\
+   create makes a new SIZE-byte ramdisk and prints its name.  If DEVICE is\n\
+       given, that ramdisk is created; otherwise the first free one is.\n\
+       BLOCKSIZE is 512 or 4096; the default is set by the module.\n\
+       -n puts the data on NUMA node NODE, -i interleaves it across all\n\
+       nodes, and -H allocates it in 2MB extents.  -m keeps at most LIMIT\n\
+       bytes of it in RAM, spilling cold pages to a file in the module's\n\
+       spill_dir.\n\
+   destroy frees DEVICE and its data.  DEVICE must not be open.\n\
+   resize changes DEVICE's size to SIZE bytes.  A device can grow while it\n\
+       is open; shrinking one discards the data past the new end.\n\
+   snapshot freezes each DEVICE's current contents, all at the same instant,\n\
+       into a new read-only device (-c: a writable clone), and prints the\n\
+       new devices' names.  Pages are copied only when one side changes\n\
+       them.  A DEVICE can have one snapshot or clone at a time; while it\n\
+       does, neither can be destroyed or resized.\n\
+   save writes DEVICE's data to image FILE, leaving out holes and zeros.\n\
+       Save a snapshot to get a consistent image of a busy device.\n\
+   restore replaces DEVICE's data with image FILE.  DEVICE must be closed\n\
+       and at least as large as the saved one.\n\
+   DEVICE defaults to /dev/osprda.  Every command but stats, discard, zero,\n\
+   flush and policy works through /dev/osprdctl.\n");
+	exit(status);
+}
+
+int parse_ull(const char *arg, unsigned long long *result)
+{
+	char *end_arg;
+	unsigned long long val = strtoull(arg, &end_arg, 0);
+	if (*arg && !*end_arg) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+int open_device(const char *devname, int mode)
+{
+	int devfd = open(devname, mode);
+	if (devfd == -1) {
+		perror(devname);
+		exit(1);
+	}
+	return devfd;
+}
+
+// Return the index of ramdisk 'devname' (/dev/osprda is 0), or -1.
+int device_index(const char *devname)
+{
+	size_t len = strlen(devname);
+	if (len < 6 || strncmp(devname + len - 6, "osprd", 5) != 0
+	    || devname[len - 1] < 'a' || devname[len - 1] > 'p')
+		return -1;
+	return devname[len - 1] - 'a';
+}
+
+const char *policy_names[] = { "fifo", "batch", "phase" };
+
+int do_stats(int argc, char *argv[])
+{
+	const char *devname = (argc >= 2 ? argv[1] : "/dev/osprda");
+	struct osprd_stats stats;
+	int devfd = open_device(devname, O_RDONLY);
+	int i;
+
+	if (ioctl(devfd, OSPRDIOCSTATS, &stats) == -1) {
+		perror("ioctl OSPRDIOCSTATS");
+		return 1;
+	}
+	printf("capacity %llu\n", stats.capacity);
+	printf("block_size %llu\n", stats.block_size);
+	printf("numa_node %lld\n", stats.numa_node);
+	printf("interleave %d\n", (stats.flags & OSPRD_DEV_INTERLEAVE) != 0);
+	printf("hugepages %d\n", (stats.flags & OSPRD_DEV_HUGEPAGES) != 0);
+	printf("readonly %d\n", (stats.flags & OSPRD_DEV_READONLY) != 0);
+	if (stats.origin >= 0)
+		printf("origin /dev/osprd%c\n", 'a' + (int) stats.origin);
+	printf("cow_copies %llu\n", stats.cow_copies);
+	printf("huge_extents %llu\n", stats.huge_extents);
+	for (i = 0; i < OSPRD_MAX_NODES; i++)
+		if (stats.node_pages[i])
+			printf("node%d_pages %llu\n", i, stats.node_pages[i]);
+	printf("used_bytes %llu\n", stats.used_bytes);
+	printf("compressed_pages %llu\n", stats.compressed_pages);
+	printf("compressed_bytes %llu\n", stats.compressed_bytes);
+	if (stats.compressed_bytes)
+		printf("compression_ratio %.2f\n", (double) stats.compressed_pages
+		       * getpagesize() / stats.compressed_bytes);
+	printf("decompressions %llu\n", stats.decompressions);
+	if (stats.decompressions)
+		printf("decompress_avg_ns %llu\n",
+		       stats.decompress_ns / stats.decompressions);
+	printf("dedup_saved_bytes %llu\n", stats.dedup_saved_bytes);
+	printf("zero_writes %llu\n", stats.zero_writes);
+	printf("reads %llu\n", stats.reads);
+	printf("writes %llu\n", stats.writes);
+	printf("read_bytes %llu\n", stats.read_bytes);
+	printf("write_bytes %llu\n", stats.write_bytes);
+	printf("dirty_pages %llu\n", stats.dirty_pages);
+	printf("flush_runs %llu\n", stats.flush_runs);
+	printf("flush_bytes %llu\n", stats.flush_bytes);
+	if (stats.lock_policy <= OSPRD_MAX_POLICY)
+		printf("lock_policy %s\n", policy_names[stats.lock_policy]);
+	printf("read_waits %llu\n", stats.read_waits);
+	if (stats.read_waits)
+		printf("read_wait_avg_ns %llu\n",
+		       stats.read_wait_ns / stats.read_waits);
+	printf("write_waits %llu\n", stats.write_waits);
+	if (stats.write_waits)
+		printf("write_wait_avg_ns %llu\n",
+		       stats.write_wait_ns / stats.write_waits);
+	printf("max_wait_ns %llu\n", stats.max_wait_ns);
+	if (stats.ram_limit) {
+		printf("ram_limit %llu\n", stats.ram_limit);
+		printf("spilled_pages %llu\n", stats.spilled_pages);
+		printf("spill_hits %llu\n", stats.spill_hits);
+		printf("spill_misses %llu\n", stats.spill_misses);
+		printf("evictions %llu\n", stats.evictions);
+	}
+	return 0;
+}
+
+int do_flush(int argc, char *argv[])
+{
+	const char *devname = (argc >= 2 ? argv[1] : "/dev/osprda");
+	int devfd = open_device(devname, O_RDONLY);
+
+	if (ioctl(devfd, OSPRDIOCFLUSH) == -1) {
+		perror("ioctl OSPRDIOCFLUSH");
+		return 1;
+	}
+	return 0;
+}
+
+int do_policy(int argc, char *argv[])
+{
+	unsigned long policy;
+	int devfd;
+
+	if (argc != 3)
+		usage(1);
+	for (policy = 0; policy <= OSPRD_MAX_POLICY; policy++)
+		if (strcmp(argv[2], policy_names[policy]) == 0)
+			break;
+	if (policy > OSPRD_MAX_POLICY)
+		usage(1);
+	devfd = open_device(argv[1], O_RDONLY);
+	if (ioctl(devfd, OSPRDIOCSETPOLICY, policy) == -1) {
+		perror("ioctl OSPRDIOCSETPOLICY");
+		return 1;
+	}
+	return 0;
+}
+
+int do_range(int argc, char *argv[], int cmd, const char *cmdname)
+{
+	struct osprd_range range;
+	int devfd;
+
+	if (argc != 4 || !parse_ull(argv[2], &range.offset)
+	    || !parse_ull(argv[3], &range.length))
+		usage(1);
+	devfd = open_device(argv[1], O_WRONLY);
+	if (ioctl(devfd, cmd, &range) == -1) {
+		perror(cmdname);
+		return 1;
+	}
+	return 0;
+}
+
+int do_device(int argc, char *argv[], int cmd, const char *cmdname)
+{
+	struct osprd_device dev;
+	const char *devname = NULL, *size = NULL;
+	unsigned long long block_size = 0, node;
+	int ctlfd;
+
+	memset(&dev, 0, sizeof(dev));
+	dev.numa_node = -1;
+	while (cmd == OSPRDIOCCREATE && argc >= 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-b") == 0 && argc >= 3
+		    && parse_ull(argv[2], &block_size))
+			argv += 2, argc -= 2;
+		else if (strcmp(argv[1], "-n") == 0 && argc >= 3
+			 && parse_ull(argv[2], &node)) {
+			dev.numa_node = node;
+			argv += 2, argc -= 2;
+		} else if (strcmp(argv[1], "-i") == 0) {
+			dev.flags |= OSPRD_DEV_INTERLEAVE;
+			argv++, argc--;
+		} else if (strcmp(argv[1], "-H") == 0) {
+			dev.flags |= OSPRD_DEV_HUGEPAGES;
+			argv++, argc--;
+		} else if (strcmp(argv[1], "-m") == 0 && argc >= 3
+			   && parse_ull(argv[2], &dev.ram_limit)) {
+			argv += 2, argc -= 2;
+		} else
+			usage(1);
+	}
+	if (cmd == OSPRDIOCCREATE && (argc == 2 || argc == 3))
+		size = argv[1], devname = (argc == 3 ? argv[2] : NULL);
+	else if (cmd == OSPRDIOCDESTROY && argc == 2)
+		devname = argv[1];
+	else if (cmd == OSPRDIOCRESIZE && argc == 3)
+		devname = argv[1], size = argv[2];
+	else
+		usage(1);
+
+	dev.index = -1;
+	dev.block_size = block_size;
+	if ((devname && (dev.index = device_index(devname)) < 0)
+	    || (size && !parse_ull(size, &dev.size)))
+		usage(1);
+
+	ctlfd = open_device("/dev/osprdctl", O_RDWR);
+	if (ioctl(ctlfd, cmd, &dev) == -1) {
+		perror(cmdname);
+		return 1;
+	}
+	if (cmd == OSPRDIOCCREATE)
+		printf("/dev/osprd%c\n", 'a' + dev.index);
+	return 0;
+}
+
+int do_snapshot(int argc, char *argv[])
+{
+	struct osprd_snapshot snap;
+	unsigned flags = 0;
+	unsigned i;
+	int ctlfd;
+
+	if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+		flags = OSPRD_SNAP_CLONE;
+		argv++, argc--;
+	}
+	if (argc < 2 || argc - 1 > OSPRD_MAX_SNAPSHOT)
+		usage(1);
+
+	memset(&snap, 0, sizeof(snap));
+	snap.count = argc - 1;
+	for (i = 0; i < snap.count; i++) {
+		char *colon = strchr(argv[i + 1], ':');
+		if (colon)
+			*colon = '\0';
+		snap.devs[i].origin = device_index(argv[i + 1]);
+		snap.devs[i].index = (colon ? device_index(colon + 1) : -1);
+		snap.devs[i].flags = flags;
+		if (snap.devs[i].origin < 0 || (colon && snap.devs[i].index < 0))
+			usage(1);
+	}
+
+	ctlfd = open_device("/dev/osprdctl", O_RDWR);
+	if (ioctl(ctlfd, OSPRDIOCSNAPSHOT, &snap) == -1) {
+		perror("ioctl OSPRDIOCSNAPSHOT");
+		return 1;
+	}
+	for (i = 0; i < snap.count; i++)
+		printf("/dev/osprd%c\n", 'a' + snap.devs[i].index);
+	return 0;
+}
+
+int do_image(int argc, char *argv[], int cmd, const char *cmdname)
+{
+	struct osprd_image img;
+	int ctlfd;
+
+	if (argc != 3 || (img.index = device_index(argv[1])) < 0
+	    || strlen(argv[2]) >= sizeof(img.path))
+		usage(1);
+	strcpy(img.path, argv[2]);
+
+	ctlfd = open_device("/dev/osprdctl", O_RDWR);
+	if (ioctl(ctlfd, cmd, &img) == -1) {
+		perror(cmdname);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || strcmp(argv[1], "-h") == 0
+	    || strcmp(argv[1], "--help") == 0)
+		usage(argc < 2);
+
+	if (strcmp(argv[1], "stats") == 0)
+		return do_stats(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "discard") == 0)
+		return do_range(argc - 1, argv + 1, OSPRDIOCDISCARD,
+				"ioctl OSPRDIOCDISCARD");
+	else if (strcmp(argv[1], "zero") == 0)
+		return do_range(argc - 1, argv + 1, OSPRDIOCZERORANGE,
+				"ioctl OSPRDIOCZERORANGE");
+	else if (strcmp(argv[1], "flush") == 0)
+		return do_flush(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "policy") == 0)
+		return do_policy(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "create") == 0)
+		return do_device(argc - 1, argv + 1, OSPRDIOCCREATE,
+				 "ioctl OSPRDIOCCREATE");
+	else if (strcmp(argv[1], "destroy") == 0)
+		return do_device(argc - 1, argv + 1, OSPRDIOCDESTROY,
+				 "ioctl OSPRDIOCDESTROY");
+	else if (strcmp(argv[1], "resize") == 0)
+		return do_device(argc - 1, argv + 1, OSPRDIOCRESIZE,
+				 "ioctl OSPRDIOCRESIZE");
+	else if (strcmp(argv[1], "snapshot") == 0)
+		return do_snapshot(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "save") == 0)
+		return do_image(argc - 1, argv + 1, OSPRDIOCSAVE,
+				"ioctl OSPRDIOCSAVE");
+	else if (strcmp(argv[1], "restore") == 0)
+		return do_image(argc - 1, argv + 1, OSPRDIOCRESTORE,
+				"ioctl OSPRDIOCRESTORE");
+	else
+		usage(1);
+	return 1;
+}